@@ -1,10 +1,44 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <ctime>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
 #include <limits>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <random>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <map>
+#include <unordered_map>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 using namespace std;
 
@@ -16,899 +50,6240 @@ const int FACULTY_MAX_BORROW = 5;
 const int FACULTY_BORROW_PERIOD = 30;
 const int FACULTY_OVERDUE_LIMIT = 60;
 
-struct BorrowRecord
-{
-    int bookId;
-    time_t borrowTime;
-};
+// For testing purposes, 10 seconds count as one day
+const int SECONDS_PER_DAY = 10;
 
-// Account Class
-class Account
-{
-private:
-    vector<BorrowRecord> borrowedRecords;
-    double fine;
+// Removed books are compacted out of the catalog once there are at least
+// this many and they make up more than half of it (or at the next checkpoint)
+const size_t COMPACT_MIN_REMOVED = 1024;
 
-public:
-    Account() : fine(0) {}
+// Replaced book titles are dropped from the string pool once they take up at
+// least this many bytes and more than half of it
+const size_t POOL_GARBAGE_MIN = 1 << 20;
 
-    vector<BorrowRecord> &getRecords() { return borrowedRecords; }
-    const vector<BorrowRecord> &getRecords() const { return borrowedRecords; }
-    double getFine() const { return fine; }
+// Number of lock shards for users and books; see Library
+const size_t LOCK_SHARDS = 64;
 
-    void addRecord(const BorrowRecord &rec) { borrowedRecords.push_back(rec); }
-    bool removeRecord(int bookId)
-    {
-        for (auto it = borrowedRecords.begin(); it != borrowedRecords.end(); ++it)
-        {
-            if (it->bookId == bookId)
-            {
-                borrowedRecords.erase(it);
-                return true;
-            }
-        }
+// Number of journal records after which the journal is folded into the snapshot files
+const int JOURNAL_CHECKPOINT_INTERVAL = 500;
+
+// Group commit: pending mutations are made durable in one flush once this many
+// have accumulated or the oldest has waited this long
+const int GROUP_COMMIT_MAX_MUTATIONS = 64;
+const int GROUP_COMMIT_MAX_DELAY_MS = 250;
+
+// With the background writer, patrons only wait for it once this many
+// mutations are still not durable
+const int WRITER_MAX_UNWRITTEN = 4096;
+
+// Data files smaller than this are parsed on a single thread
+const size_t PARALLEL_LOAD_MIN_BYTES = 1 << 20;
+
+// Binary snapshot (data/library.bin) identification. Bump the version whenever
+// the layout below changes.
+const char SNAPSHOT_MAGIC[4] = {'L', 'M', 'S', 'B'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+// Files a snapshot commit may replace; see Library::commitSnapshot
+const char *const SNAPSHOT_FILES[] = {"books.txt", "users.txt", "fines.txt", "library.bin"};
+
+// Flush a stdio stream all the way to stable storage
+static bool syncFile(FILE *f)
+{
+    if (fflush(f) != 0)
         return false;
-    }
-    void addFine(double amount) { fine += amount; }
-    void clearFine() { fine = 0; }
-};
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
 
-// Book Class
-class Book
+static bool fileExists(const string &path)
 {
-private:
-    int id;
-    string title;
-    string author;
-    string publisher;
-    string isbn;
-    int year;
-    string status;
-    int reservedBy;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == nullptr)
+        return false;
+    fclose(f);
+    return true;
+}
 
-public:
-    Book() : id(0), year(0), status("Available"), reservedBy(-1) {}
-    Book(int id, string title, string author, string publisher, int year, string isbn, string status = "Available", int reservedBy = -1)
-        : id(id), title(title), author(author), publisher(publisher), isbn(isbn), year(year), status(status), reservedBy(reservedBy) {}
+// Write a whole file in one go and flush it to stable storage
+static bool writeFileDurably(const string &path, const string &contents)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == nullptr)
+        return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size() && syncFile(f);
+    return fclose(f) == 0 && ok;
+}
 
-    int getId() const { return id; }
-    string getTitle() const { return title; }
-    string getAuthor() const { return author; }
-    string getPublisher() const { return publisher; }
-    int getYear() const { return year; }
-    string getIsbn() const { return isbn; }
-    string getStatus() const { return status; }
-    int getReservedBy() const { return reservedBy; }
+// Rename 'from' over 'to'. Atomic on POSIX; on Windows the old file is removed
+// first, which the snapshot manifest makes safe to redo after a crash.
+static bool replaceFile(const string &from, const string &to)
+{
+#ifdef _WIN32
+    remove(to.c_str());
+#endif
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+// Make renames within a directory durable
+static bool syncDirectory(const string &dir)
+{
+#ifdef _WIN32
+    (void)dir;
+    return true;
+#else
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+// Book circulation status and user role. Held as one byte each in memory and
+// converted to text only when reading or writing files and for display.
+enum class BookStatus : uint8_t
+{
+    Available,
+    Borrowed,
+    Reserved
+};
 
-    void setTitle(const string &t) { title = t; }
-    void setStatus(const string &s) { status = s; }
-    void setReservedBy(int uid) { reservedBy = uid; }
-    void clearReservation() { reservedBy = -1; }
+enum class UserRole : uint8_t
+{
+    Student,
+    Faculty,
+    Librarian
+};
 
-    void display() const
+static const char *toString(BookStatus status)
+{
+    switch (status)
     {
-        cout << id << ": " << title << " by " << author << " (" << year << ") - " << status;
-        if (reservedBy != -1)
-            cout << " [Reserved by User ID " << reservedBy << "]";
-        cout << endl;
+    case BookStatus::Borrowed:
+        return "Borrowed";
+    case BookStatus::Reserved:
+        return "Reserved";
+    default:
+        return "Available";
     }
-};
+}
 
-// Forward Declaration of Library
-class Library;
+static const char *toString(UserRole role)
+{
+    switch (role)
+    {
+    case UserRole::Faculty:
+        return "Faculty";
+    case UserRole::Librarian:
+        return "Librarian";
+    default:
+        return "Student";
+    }
+}
 
-// User Base Class
-class User
+static bool parseBookStatus(string_view text, BookStatus &status)
 {
-private:
-    int id;
-    string username;
-    string password;
-    string name;
-    string role;
-    Account account;
+    if (text == "Available")
+        status = BookStatus::Available;
+    else if (text == "Borrowed")
+        status = BookStatus::Borrowed;
+    else if (text == "Reserved")
+        status = BookStatus::Reserved;
+    else
+        return false;
+    return true;
+}
 
-public:
-    User() : id(0) {}
-    User(int id, string username, string password, string name, string role)
-        : id(id), username(username), password(password), name(name), role(role) {}
+static bool parseUserRole(string_view text, UserRole &role)
+{
+    if (text == "Student")
+        role = UserRole::Student;
+    else if (text == "Faculty")
+        role = UserRole::Faculty;
+    else if (text == "Librarian")
+        role = UserRole::Librarian;
+    else
+        return false;
+    return true;
+}
 
-    int getId() const { return id; }
-    string getUsername() const { return username; }
-    string getPassword() const { return password; }
-    string getName() const { return name; }
-    string getRole() const { return role; }
-    Account &getAccount() { return account; }
-    const Account &getAccount() const { return account; }
+ostream &operator<<(ostream &out, BookStatus status) { return out << toString(status); }
+ostream &operator<<(ostream &out, UserRole role) { return out << toString(role); }
 
-    virtual void dashboard(Library &lib) = 0;
-    virtual ~User() {}
-};
+// Days elapsed between two times
+static double daysBetween(time_t from, time_t to) { return difftime(to, from) / SECONDS_PER_DAY; }
 
-// Derived Classes
-class Student : public User
+struct BorrowRecord
 {
-public:
-    Student(int id, string username, string password, string name)
-        : User(id, username, password, name, "Student") {}
-    void dashboard(Library &lib) override;
+    int bookId;
+    time_t borrowTime;
 };
 
-class Faculty : public User
+// Who holds a book on loan, and since when
+struct Borrower
 {
-public:
-    Faculty(int id, string username, string password, string name)
-        : User(id, username, password, name, "Faculty") {}
-    void dashboard(Library &lib) override;
+    int userId;
+    time_t borrowTime;
 };
 
-class Librarian : public User
+// Loan List
+// A user's open loans, stored inline in the account. The borrowing limits
+// keep this at five or fewer, so no separate allocation is needed; if data
+// loaded from a file holds more, the list moves to the heap.
+class LoanList
 {
 public:
-    Librarian(int id, string username, string password, string name)
-        : User(id, username, password, name, "Librarian") {}
-    void dashboard(Library &lib) override;
-};
+    static const size_t INLINE_CAPACITY = 5;
 
-// Library Class
-class Library
-{
 private:
-    vector<Book> books;
-    vector<User *> users;
+    BorrowRecord inlineRecords[INLINE_CAPACITY];
+    vector<BorrowRecord> spilled; // all records once there are too many to fit inline
+    uint8_t inlineCount;
+
+public:
+    LoanList() : inlineCount(0) {}
+
+    const BorrowRecord *begin() const { return spilled.empty() ? inlineRecords : spilled.data(); }
+    const BorrowRecord *end() const { return begin() + size(); }
+    size_t size() const { return spilled.empty() ? inlineCount : spilled.size(); }
+    bool empty() const { return size() == 0; }
 
-    // Save Borrow records and fines to a file
-    void saveLoanData()
+    void push_back(const BorrowRecord &rec)
     {
-        ofstream loanOut("./data/fines.txt");
-        if (!loanOut)
+        if (spilled.empty() && inlineCount < INLINE_CAPACITY)
         {
-            cout << "Error: Cannot open fines.txt for writing.\n";
+            inlineRecords[inlineCount++] = rec;
             return;
         }
-        for (auto user : users)
+        if (spilled.empty())
         {
-            for (auto &rec : user->getAccount().getRecords())
-            {
-                loanOut << user->getId() << "," << rec.bookId << "," << rec.borrowTime << "\n";
-            }
-            loanOut << user->getId() << ",FINE," << user->getAccount().getFine() << "\n";
+            spilled.assign(inlineRecords, inlineRecords + inlineCount);
+            inlineCount = 0;
         }
-        loanOut.close();
+        spilled.push_back(rec);
     }
 
-    void loadLoanData()
+    // Remove the record at index, keeping the others in order
+    void erase(size_t index)
     {
-        ifstream loanFile("./data/fines.txt");
-        if (!loanFile)
+        if (!spilled.empty())
         {
-            cout << "fines.txt not found. Starting with empty loan records.\n";
+            spilled.erase(spilled.begin() + index);
             return;
         }
-        string line;
-        while (getline(loanFile, line))
+        for (size_t i = index + 1; i < inlineCount; ++i)
+            inlineRecords[i - 1] = inlineRecords[i];
+        --inlineCount;
+    }
+};
+
+static_assert(STUDENT_MAX_BORROW <= (int)LoanList::INLINE_CAPACITY && FACULTY_MAX_BORROW <= (int)LoanList::INLINE_CAPACITY,
+              "loans within the borrowing limits must fit inline");
+
+// Account Class
+class Account
+{
+private:
+    LoanList borrowedRecords;
+    double fine;
+    time_t oldestBorrow; // borrowTime of the oldest loan, kept by addRecord/removeRecord
+
+public:
+    Account() : fine(0), oldestBorrow(numeric_limits<time_t>::max()) {}
+
+    const LoanList &getRecords() const { return borrowedRecords; }
+    double getFine() const { return fine; }
+
+    // Borrow time of the oldest open loan, or the largest time_t when there is none
+    time_t getOldestBorrowTime() const { return oldestBorrow; }
+
+    void addRecord(const BorrowRecord &rec)
+    {
+        borrowedRecords.push_back(rec);
+        oldestBorrow = min(oldestBorrow, rec.borrowTime);
+    }
+    bool removeRecord(int bookId)
+    {
+        for (size_t i = 0; i < borrowedRecords.size(); ++i)
         {
-            if (line.empty())
-                continue;
-            istringstream iss(line);
-            vector<string> tokens;
-            string token;
-            while (getline(iss, token, ','))
+            if (borrowedRecords.begin()[i].bookId == bookId)
             {
-                tokens.push_back(token);
-            }
-            if (tokens.size() < 3)
-                continue;
-            int userId = stoi(tokens[0]);
-            User *foundUser = nullptr;
-            for (auto u : users)
-            {
-                if (u->getId() == userId)
+                time_t removed = borrowedRecords.begin()[i].borrowTime;
+                borrowedRecords.erase(i);
+                if (removed == oldestBorrow)
                 {
-                    foundUser = u;
-                    break;
+                    oldestBorrow = numeric_limits<time_t>::max();
+                    for (auto &rec : borrowedRecords)
+                        oldestBorrow = min(oldestBorrow, rec.borrowTime);
                 }
-            }
-            if (foundUser == nullptr)
-                continue;
-            if (tokens[1] == "FINE")
-            {
-                foundUser->getAccount().clearFine();
-                foundUser->getAccount().addFine(stod(tokens[2]));
-            }
-            else
-            {
-                BorrowRecord rec;
-                rec.bookId = stoi(tokens[1]);
-                rec.borrowTime = (time_t)stoll(tokens[2]);
-                foundUser->getAccount().getRecords().push_back(rec);
+                return true;
             }
         }
-        loanFile.close();
+        return false;
     }
+    void addFine(double amount) { fine += amount; }
+    void clearFine() { fine = 0; }
+};
+
+// Mapped File
+// Read-only view of a whole data file. The file is memory-mapped where the
+// platform supports it and read into a buffer otherwise.
+class MappedFile
+{
+private:
+    const char *data;
+    size_t size;
+    string buffer;
+#ifndef _WIN32
+    void *mapping;
+#endif
 
 public:
-    Library() {}
-    ~Library()
+#ifdef _WIN32
+    MappedFile() : data(nullptr), size(0) {}
+#else
+    MappedFile() : data(nullptr), size(0), mapping(nullptr) {}
+#endif
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
     {
-        for (auto u : users)
-            delete u;
+#ifndef _WIN32
+        if (mapping)
+            munmap(mapping, size);
+#endif
     }
 
-    vector<Book> &getBooks() { return books; }
-    vector<User *> &getUsers() { return users; }
-
-    void displayAvailableBooksForUser(int userId)
+    bool open(const string &path)
     {
-        cout << "\nAvailable Books:\n";
-        for (auto &book : books)
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
         {
-            if (book.getStatus() == "Available" ||
-                (book.getStatus() == "Reserved" && book.getReservedBy() == userId))
-                book.display();
+            close(fd);
+            return false;
         }
-    }
-
-    void displayAvailableBooks()
-    {
-        cout << "\nAvailable Books:\n";
-        for (auto &book : books)
+        size = (size_t)st.st_size;
+        if (size > 0)
         {
-            if (book.getStatus() == "Available")
-                book.display();
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                mapping = nullptr;
+                size = 0;
+                close(fd);
+                return false;
+            }
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            data = static_cast<const char *>(mapping);
         }
+        close(fd);
+        return true;
+#else
+        ifstream in(path, ios::binary);
+        if (!in)
+            return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+#endif
     }
 
-    Book *findBookById(int id)
+    string_view view() const { return string_view(data, size); }
+};
+
+// Binary Snapshot Encoding
+// Snapshot layout (all integers in host byte order):
+//   header:  magic[4] version:u32 payloadBytes:u64 checksum:u64
+//   books:   count:u64, then columns id:i32[] year:i32[] reservedBy:i32[] status:u8[],
+//            then title/author/publisher/isbn strings per book
+//   users:   count:u64, then columns id:i32[] role:u8[] fine:f64[],
+//            then username/password/name strings per user
+//   loans:   count:u64, then columns userId:i32[] bookId:i32[] borrowTime:i64[]
+// Strings are a u32 length followed by the bytes. The checksum is FNV-1a over the payload.
+struct SnapshotHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t payloadBytes;
+    uint64_t checksum;
+};
+
+static uint64_t fnv1a(const char *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i)
     {
-        for (auto &book : books)
-        {
-            if (book.getId() == id)
-                return &book;
-        }
-        return nullptr;
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
+
+class BinaryWriter
+{
+private:
+    string buffer;
+
+public:
+    template <typename T>
+    void put(const T &value) { buffer.append(reinterpret_cast<const char *>(&value), sizeof(T)); }
 
-    bool bookExists(int bid)
+    // Append a whole column of fixed-width values in one copy
+    template <typename T>
+    void putColumn(const vector<T> &column)
     {
-        for (auto &book : books)
-        {
-            if (book.getId() == bid)
-                return true;
-        }
-        return false;
+        if (!column.empty())
+            buffer.append(reinterpret_cast<const char *>(column.data()), column.size() * sizeof(T));
     }
 
-    bool userExists(int uid)
+    void putString(string_view str)
     {
-        for (auto user : users)
-        {
-            if (user->getId() == uid)
-                return true;
-        }
-        return false;
+        put((uint32_t)str.size());
+        buffer.append(str);
     }
 
-    void loadData()
-    {
-        // Load books
-        ifstream infile("./data/books.txt");
-        if (infile)
-        {
-            string line;
-            while (getline(infile, line))
-            {
-                if (line.empty())
-                    continue;
-                istringstream iss(line);
-                vector<string> tokens;
-                string token;
-                while (getline(iss, token, ','))
-                {
-                    tokens.push_back(token);
-                }
-                if (tokens.size() == 8)
-                {
-                    int id = stoi(tokens[0]);
-                    int year = stoi(tokens[4]);
-                    int reserved = stoi(tokens[7]);
-                    books.push_back(Book(id, tokens[1], tokens[2], tokens[3], year, tokens[5], tokens[6], reserved));
-                }
-                else if (tokens.size() == 7)
-                {
-                    int id = stoi(tokens[0]);
-                    int year = stoi(tokens[4]);
-                    books.push_back(Book(id, tokens[1], tokens[2], tokens[3], year, tokens[5], tokens[6], -1));
-                }
-            }
-            infile.close();
-        }
-        else
-        {
-            cout << "books.txt not found. Starting with empty book list.\n";
-        }
+    const string &data() const { return buffer; }
+};
 
-        // Load users
-        ifstream ufile("./data/users.txt");
-        if (ufile)
-        {
-            string line;
-            while (getline(ufile, line))
-            {
-                if (line.empty())
-                    continue;
-                istringstream iss(line);
-                vector<string> tokens;
-                string token;
-                while (getline(iss, token, ','))
-                {
-                    tokens.push_back(token);
-                }
-                if (tokens.size() != 5)
-                    continue;
-                int id = stoi(tokens[0]);
-                string urole = tokens[3];
-                if (urole == "Student")
-                    users.push_back(new Student(id, tokens[1], tokens[2], tokens[4]));
-                else if (urole == "Faculty")
-                    users.push_back(new Faculty(id, tokens[1], tokens[2], tokens[4]));
-                else if (urole == "Librarian")
-                    users.push_back(new Librarian(id, tokens[1], tokens[2], tokens[4]));
-            }
-            ufile.close();
-        }
-        else
-        {
-            cout << "users.txt not found. Starting with empty user list.\n";
-        }
+// Bounds-checked cursor over a snapshot payload. Every read returns false
+// once the payload is exhausted.
+class BinaryReader
+{
+private:
+    string_view rest;
 
-        loadLoanData();
+public:
+    explicit BinaryReader(string_view payload) : rest(payload) {}
+
+    template <typename T>
+    bool get(T &value)
+    {
+        if (rest.size() < sizeof(T))
+            return false;
+        memcpy(&value, rest.data(), sizeof(T));
+        rest.remove_prefix(sizeof(T));
+        return true;
     }
 
-    void saveData()
+    template <typename T>
+    bool getColumn(vector<T> &column, size_t count)
     {
-        ofstream outfile("./data/books.txt");
-        if (outfile)
-        {
-            for (auto &book : books)
-            {
-                outfile << book.getId() << "," << book.getTitle() << "," << book.getAuthor() << ","
-                        << book.getPublisher() << "," << book.getYear() << "," << book.getIsbn() << ","
-                        << book.getStatus() << "," << book.getReservedBy() << "\n";
-            }
-            outfile.close();
-        }
+        if (count > rest.size() / sizeof(T))
+            return false;
+        column.resize(count);
+        if (count > 0)
+            memcpy(column.data(), rest.data(), count * sizeof(T));
+        rest.remove_prefix(count * sizeof(T));
+        return true;
+    }
 
-        ofstream uoutfile("./data/users.txt");
-        if (uoutfile)
-        {
-            for (auto user : users)
-            {
-                uoutfile << user->getId() << "," << user->getUsername() << "," << user->getPassword() << ","
-                         << user->getRole() << "," << user->getName() << "\n";
-            }
-            uoutfile.close();
-        }
-        saveLoanData();
+    // The string is a view into the payload
+    bool getString(string_view &str)
+    {
+        uint32_t len;
+        if (!get(len) || rest.size() < len)
+            return false;
+        str = rest.substr(0, len);
+        rest.remove_prefix(len);
+        return true;
+    }
+
+    bool getString(string &str)
+    {
+        string_view view;
+        if (!getString(view))
+            return false;
+        str.assign(view.data(), view.size());
+        return true;
     }
+
+    bool atEnd() const { return rest.empty(); }
 };
 
-// Student Dashboard
-void Student::dashboard(Library &lib)
+// Calls fn(line, lineNo) for every non-empty line in text, with any trailing
+// '\r' removed. Line numbers start at firstLineNo.
+template <typename Fn>
+static void forEachLine(string_view text, size_t firstLineNo, Fn fn)
 {
-    int choice;
-    do
+    size_t lineNo = firstLineNo;
+    while (!text.empty())
     {
-        cout << "\n--- STUDENT DASHBOARD (" << getName() << ") ---\n";
-        cout << "1. View Available Books\n";
-        cout << "2. Borrow a Book\n";
-        cout << "3. Return a Book\n";
-        cout << "4. View Borrowed Books\n";
-        cout << "5. Check Fine Amount\n";
+        size_t end = text.find('\n');
+        string_view line = text.substr(0, end);
+        text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (!line.empty())
+            fn(line, lineNo);
+        ++lineNo;
+    }
+}
+
+// Field Escaping
+// Text fields written to the journal and the text snapshot files may contain
+// the ',' separator. A backslash escapes ',' and itself, and line breaks are
+// written as \n and \r, so every record stays on one line. Text files written
+// before escaping was introduced are read literally; see
+// Library::escapedFiles.
+static void appendField(string &out, string_view field)
+{
+    if (field.find_first_of(",\\\n\r") == string_view::npos)
+    {
+        out += field;
+        return;
+    }
+    for (char c : field)
+    {
+        if (c == ',' || c == '\\')
+            out += '\\';
+        if (c == '\n')
+            out += "\\n";
+        else if (c == '\r')
+            out += "\\r";
+        else
+            out += c;
+    }
+}
+
+static string escapeField(string_view field)
+{
+    string out;
+    appendField(out, field);
+    return out;
+}
+
+// Undo appendField on a field sliced out by splitFields
+static string unescapeField(string_view field)
+{
+    if (field.find('\\') == string_view::npos)
+        return string(field);
+    string out;
+    for (size_t i = 0; i < field.size(); ++i)
+    {
+        char c = field[i];
+        if (c == '\\' && i + 1 < field.size())
+        {
+            c = field[++i];
+            if (c == 'n')
+                c = '\n';
+            else if (c == 'r')
+                c = '\r';
+        }
+        out += c;
+    }
+    return out;
+}
+
+// Position of the first ',' in line that is not escaped, or npos
+static size_t findSeparator(string_view line, bool escaped)
+{
+    if (!escaped)
+        return line.find(',');
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+        if (line[i] == '\\')
+            ++i;
+        else if (line[i] == ',')
+            return i;
+    }
+    return string_view::npos;
+}
+
+// Split line on unescaped ',' into at most maxFields slices of the original
+// text. Returns the number of fields found, or maxFields + 1 if there are more.
+// Unless escapes is set, a backslash is an ordinary character.
+static size_t splitFields(string_view line, string_view *fields, size_t maxFields, bool escapes = true)
+{
+    size_t count = 0;
+    bool escaped = escapes && line.find('\\') != string_view::npos;
+    while (true)
+    {
+        size_t comma = findSeparator(line, escaped);
+        if (count == maxFields)
+            return maxFields + 1;
+        fields[count++] = line.substr(0, comma);
+        if (comma == string_view::npos)
+            return count;
+        line.remove_prefix(comma + 1);
+    }
+}
+
+// Parse the whole of text as a number; returns false on any stray characters
+template <typename T>
+static bool parseNumber(string_view text, T &out)
+{
+    const char *end = text.data() + text.size();
+    auto result = from_chars(text.data(), end, out);
+    return result.ec == errc() && result.ptr == end;
+}
+
+// Book Class
+// A book as read from a data file or entered by a librarian. The catalog
+// itself keeps books in a BookStore.
+class Book
+{
+private:
+    int id;
+    string title;
+    string author;
+    string publisher;
+    string isbn;
+    int year;
+    BookStatus status;
+    int reservedBy;
+
+public:
+    Book() : id(0), year(0), status(BookStatus::Available), reservedBy(-1) {}
+    Book(int id, string title, string author, string publisher, int year, string isbn,
+         BookStatus status = BookStatus::Available, int reservedBy = -1)
+        : id(id), title(title), author(author), publisher(publisher), isbn(isbn), year(year), status(status), reservedBy(reservedBy) {}
+
+    int getId() const { return id; }
+    const string &getTitle() const { return title; }
+    const string &getAuthor() const { return author; }
+    const string &getPublisher() const { return publisher; }
+    int getYear() const { return year; }
+    const string &getIsbn() const { return isbn; }
+    BookStatus getStatus() const { return status; }
+    int getReservedBy() const { return reservedBy; }
+};
+
+// String Pool
+// Holds the catalog's text in large blocks that never move, behind 32-bit
+// handles. Values that repeat across a catalog, such as authors and
+// publishers, are interned so that each is stored only once.
+class StringPool
+{
+private:
+    static const size_t BLOCK_SIZE = 1 << 16;
+
+    vector<unique_ptr<char[]>> blocks;
+    size_t blockUsed;
+    size_t blockCapacity;
+    size_t storedBytes;
+    vector<string_view> entries; // handle -> text
+    unordered_map<string_view, uint32_t> interned;
+
+    string_view store(string_view text)
+    {
+        if (text.empty())
+            return string_view();
+        if (blockUsed + text.size() > blockCapacity)
+        {
+            blockCapacity = text.size() > BLOCK_SIZE ? text.size() : BLOCK_SIZE;
+            blocks.emplace_back(new char[blockCapacity]);
+            blockUsed = 0;
+        }
+        char *at = blocks.back().get() + blockUsed;
+        memcpy(at, text.data(), text.size());
+        blockUsed += text.size();
+        storedBytes += text.size();
+        return string_view(at, text.size());
+    }
+
+public:
+    StringPool() : blockUsed(0), blockCapacity(0), storedBytes(0) {}
+
+    // Store a copy of text under a new handle
+    uint32_t add(string_view text)
+    {
+        entries.push_back(store(text));
+        return (uint32_t)(entries.size() - 1);
+    }
+
+    // The handle of an equal string already in the pool, or a new one
+    uint32_t intern(string_view text)
+    {
+        auto it = interned.find(text);
+        if (it != interned.end())
+            return it->second;
+        uint32_t handle = add(text);
+        interned.emplace(entries[handle], handle);
+        return handle;
+    }
+
+    string_view view(uint32_t handle) const { return entries[handle]; }
+
+    // Bytes of text stored, including any no longer referenced
+    size_t bytes() const { return storedBytes; }
+};
+
+// Book Store
+// The catalog, split by how often each part is read. Circulation, the
+// availability bitmaps and consistency checks only touch the dense array of
+// hot fields (ID, reservation, status); the text fields live in a separate
+// cold array of handles into a StringPool and are read when a book is
+// shown, indexed or saved.
+struct BookState
+{
+    int32_t id;
+    int32_t reservedBy;
+    BookStatus status;
+};
+
+struct BookText
+{
+    uint32_t title;
+    uint32_t author;    // interned
+    uint32_t publisher; // interned
+    uint32_t isbn;
+    int32_t year;
+};
+
+// Read-only view of one book in a BookStore. The text getters return views
+// into the store, valid until the catalog is compacted or cleared.
+class BookView
+{
+private:
+    const BookState *state;
+    const BookText *text;
+    const StringPool *pool;
+
+public:
+    BookView(const BookState *state, const BookText *text, const StringPool *pool) : state(state), text(text), pool(pool) {}
+
+    int getId() const { return state->id; }
+    string_view getTitle() const { return pool->view(text->title); }
+    string_view getAuthor() const { return pool->view(text->author); }
+    string_view getPublisher() const { return pool->view(text->publisher); }
+    int getYear() const { return text->year; }
+    string_view getIsbn() const { return pool->view(text->isbn); }
+    BookStatus getStatus() const { return state->status; }
+    int getReservedBy() const { return state->reservedBy; }
+
+    // Lets a BookHandle hand out a view through its operator->
+    const BookView *operator->() const { return this; }
+
+    // Append this book's one-line listing entry to out
+    void display(string &out) const
+    {
+        out += to_string(getId());
+        out += ": ";
+        out += getTitle();
+        out += " by ";
+        out += getAuthor();
+        out += " (";
+        out += to_string(getYear());
+        out += ") - ";
+        out += toString(getStatus());
+        if (getReservedBy() != -1)
+        {
+            out += " [Reserved by User ID ";
+            out += to_string(getReservedBy());
+            out += "]";
+        }
+        out += '\n';
+    }
+};
+
+// IDs present in every one of the sorted lists (at least one list)
+static vector<int> intersectAll(vector<vector<int>> &lists)
+{
+    // Intersect starting from the shortest list
+    sort(lists.begin(), lists.end(), [](const vector<int> &a, const vector<int> &b) { return a.size() < b.size(); });
+    vector<int> result = lists[0];
+    for (size_t i = 1; i < lists.size() && !result.empty(); ++i)
+    {
+        vector<int> merged;
+        set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(), back_inserter(merged));
+        result.swap(merged);
+    }
+    return result;
+}
+
+// Search Index
+// Inverted index from lower-cased words of each book's title, author and
+// publisher to the sorted IDs of the books containing them. Queries match every
+// word as a prefix and return the books matching all of them.
+class SearchIndex
+{
+private:
+    map<string, vector<int>> postings;
+
+    // Split text into lower-cased alphanumeric words
+    static void tokenize(string_view text, vector<string> &words)
+    {
+        string word;
+        for (char c : text)
+        {
+            if (isalnum((unsigned char)c))
+                word += (char)tolower((unsigned char)c);
+            else if (!word.empty())
+            {
+                words.push_back(word);
+                word.clear();
+            }
+        }
+        if (!word.empty())
+            words.push_back(word);
+    }
+
+    static vector<string> bookWords(const BookView &book)
+    {
+        vector<string> words;
+        tokenize(book.getTitle(), words);
+        tokenize(book.getAuthor(), words);
+        tokenize(book.getPublisher(), words);
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+        return words;
+    }
+
+    // Sorted, de-duplicated IDs of books with a word starting with prefix
+    vector<int> matchPrefix(const string &prefix) const
+    {
+        auto first = postings.lower_bound(prefix);
+        auto it = first;
+        while (it != postings.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+            ++it;
+        if (first == it)
+            return vector<int>();
+        if (next(first) == it)
+            return first->second;
+        vector<int> ids;
+        for (auto p = first; p != it; ++p)
+            ids.insert(ids.end(), p->second.begin(), p->second.end());
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+
+public:
+    void add(const BookView &book)
+    {
+        int id = book.getId();
+        for (auto &word : bookWords(book))
+        {
+            vector<int> &ids = postings[word];
+            // Books usually arrive in ID order, so this is normally an append
+            if (ids.empty() || ids.back() < id)
+                ids.push_back(id);
+            else
+                ids.insert(lower_bound(ids.begin(), ids.end(), id), id);
+        }
+    }
+
+    void remove(const BookView &book)
+    {
+        int id = book.getId();
+        for (auto &word : bookWords(book))
+        {
+            auto it = postings.find(word);
+            if (it == postings.end())
+                continue;
+            vector<int> &ids = it->second;
+            auto pos = lower_bound(ids.begin(), ids.end(), id);
+            if (pos != ids.end() && *pos == id)
+                ids.erase(pos);
+            if (ids.empty())
+                postings.erase(it);
+        }
+    }
+
+    void clear() { postings.clear(); }
+
+    // Replace the contents with the words of every book in books. Lists are
+    // gathered in a hash table and moved into the ordered index once, which
+    // beats adding a large catalog book by book.
+    template <typename Store>
+    void assign(const Store &books)
+    {
+        unordered_map<string, vector<int>> lists;
+        for (size_t slot = 0; slot < books.size(); ++slot)
+        {
+            BookView book = books[slot];
+            for (auto &word : bookWords(book))
+                lists[word].push_back(book.getId());
+        }
+        vector<pair<string, vector<int>>> sorted(make_move_iterator(lists.begin()), make_move_iterator(lists.end()));
+        lists = unordered_map<string, vector<int>>();
+        sort(sorted.begin(), sorted.end(), [](const pair<string, vector<int>> &a, const pair<string, vector<int>> &b) {
+            return a.first < b.first;
+        });
+        postings.clear();
+        for (auto &entry : sorted)
+        {
+            vector<int> &ids = entry.second;
+            if (!is_sorted(ids.begin(), ids.end()))
+                sort(ids.begin(), ids.end());
+            postings.emplace_hint(postings.end(), move(entry.first), move(ids));
+        }
+    }
+
+    vector<int> search(const string &query) const
+    {
+        vector<string> words;
+        tokenize(query, words);
+        if (words.empty())
+            return vector<int>();
+
+        vector<vector<int>> lists;
+        for (auto &word : words)
+        {
+            lists.push_back(matchPrefix(word));
+            if (lists.back().empty())
+                return vector<int>();
+        }
+
+        return intersectAll(lists);
+    }
+};
+
+// Blocked Index
+// Sorted (key, ID) pairs split into consecutive sorted blocks of bounded
+// size, so an insert or erase moves one block's entries instead of the whole
+// index. Meant for nearly unique keys, where per-key ID lists would cost a
+// tree node for every book.
+class BlockedIndex
+{
+public:
+    typedef pair<string, int> Entry;
+
+private:
+    static const size_t BLOCK_ENTRIES = 512;
+
+    vector<vector<Entry>> blocks; // in key order; none is ever empty
+
+    // The block that holds, or would hold, entry
+    size_t blockFor(const Entry &entry) const
+    {
+        auto it = lower_bound(blocks.begin(), blocks.end(), entry,
+                              [](const vector<Entry> &block, const Entry &e) { return block.back() < e; });
+        size_t b = it - blocks.begin();
+        return b == blocks.size() ? b - 1 : b;
+    }
+
+public:
+    void insert(Entry entry)
+    {
+        if (blocks.empty())
+        {
+            blocks.emplace_back();
+            blocks.back().push_back(move(entry));
+            return;
+        }
+        size_t b = blockFor(entry);
+        vector<Entry> &block = blocks[b];
+        block.insert(upper_bound(block.begin(), block.end(), entry), move(entry));
+        if (block.size() >= 2 * BLOCK_ENTRIES)
+        {
+            vector<Entry> upper(make_move_iterator(block.begin() + BLOCK_ENTRIES), make_move_iterator(block.end()));
+            block.resize(BLOCK_ENTRIES);
+            blocks.insert(blocks.begin() + b + 1, move(upper));
+        }
+    }
+
+    void erase(const Entry &entry)
+    {
+        if (blocks.empty())
+            return;
+        size_t b = blockFor(entry);
+        vector<Entry> &block = blocks[b];
+        auto it = lower_bound(block.begin(), block.end(), entry);
+        if (it == block.end() || *it != entry)
+            return;
+        block.erase(it);
+        if (block.empty())
+            blocks.erase(blocks.begin() + b);
+    }
+
+    // Replace the contents with entries, in any order
+    void assign(vector<Entry> &entries)
+    {
+        sort(entries.begin(), entries.end());
+        blocks.clear();
+        for (size_t i = 0; i < entries.size(); i += BLOCK_ENTRIES)
+        {
+            size_t end = min(entries.size(), i + BLOCK_ENTRIES);
+            blocks.emplace_back(make_move_iterator(entries.begin() + i), make_move_iterator(entries.begin() + end));
+        }
+    }
+
+    void clear() { blocks.clear(); }
+
+    // Call fn(entry) for every entry not less than from, in order, until fn returns false
+    template <typename Fn>
+    void forEachFrom(const Entry &from, Fn fn) const
+    {
+        if (blocks.empty())
+            return;
+        for (size_t b = blockFor(from); b < blocks.size(); ++b)
+        {
+            const vector<Entry> &block = blocks[b];
+            for (auto it = lower_bound(block.begin(), block.end(), from); it != block.end(); ++it)
+            {
+                if (!fn(*it))
+                    return;
+            }
+        }
+    }
+};
+
+// Catalog Index
+// Ordered indexes over publication year, author (compared ignoring case) and
+// ISBN (compared ignoring hyphens and spaces). Each lookup is a logarithmic
+// search plus the size of its answer and returns sorted book IDs, so results
+// combine with each other like SearchIndex postings.
+class CatalogIndex
+{
+private:
+    map<int, vector<int>> byYear;
+    map<string, vector<int>> byAuthor;
+    BlockedIndex byIsbn;
+    // While loading, ISBN entries added and removed are collected here and
+    // applied once at the end
+    vector<BlockedIndex::Entry> pendingIsbns;
+    vector<BlockedIndex::Entry> removedIsbns;
+    bool deferSort;
+
+    static string authorKey(string_view author)
+    {
+        string key;
+        for (char c : author)
+            key += (char)tolower((unsigned char)c);
+        return key;
+    }
+
+    static string isbnKey(string_view isbn)
+    {
+        string key;
+        for (char c : isbn)
+        {
+            if (c != '-' && c != ' ')
+                key += (char)toupper((unsigned char)c);
+        }
+        return key;
+    }
+
+    static void insertId(vector<int> &ids, int id)
+    {
+        if (ids.empty() || ids.back() < id)
+            ids.push_back(id);
+        else
+            ids.insert(lower_bound(ids.begin(), ids.end(), id), id);
+    }
+
+    template <typename Key>
+    static void eraseId(map<Key, vector<int>> &index, const Key &key, int id)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return;
+        vector<int> &ids = it->second;
+        auto pos = lower_bound(ids.begin(), ids.end(), id);
+        if (pos != ids.end() && *pos == id)
+            ids.erase(pos);
+        if (ids.empty())
+            index.erase(it);
+    }
+
+public:
+    CatalogIndex() : deferSort(false) {}
+
+    void add(const BookView &book)
+    {
+        insertId(byYear[book.getYear()], book.getId());
+        insertId(byAuthor[authorKey(book.getAuthor())], book.getId());
+        BlockedIndex::Entry entry(isbnKey(book.getIsbn()), book.getId());
+        if (deferSort)
+            pendingIsbns.push_back(move(entry));
+        else
+            byIsbn.insert(move(entry));
+    }
+
+    void remove(const BookView &book)
+    {
+        eraseId(byYear, book.getYear(), book.getId());
+        eraseId(byAuthor, authorKey(book.getAuthor()), book.getId());
+        BlockedIndex::Entry entry(isbnKey(book.getIsbn()), book.getId());
+        if (deferSort)
+            removedIsbns.push_back(move(entry));
+        else
+            byIsbn.erase(entry);
+    }
+
+    void clear()
+    {
+        byYear.clear();
+        byAuthor.clear();
+        byIsbn.clear();
+        pendingIsbns.clear();
+        removedIsbns.clear();
+    }
+
+    // Replace the contents with every book in books, sorting each index once
+    template <typename Store>
+    void assign(const Store &books)
+    {
+        clear();
+        unordered_map<string, vector<int>> authors;
+        vector<BlockedIndex::Entry> isbns;
+        isbns.reserve(books.size());
+        for (size_t slot = 0; slot < books.size(); ++slot)
+        {
+            BookView book = books[slot];
+            byYear[book.getYear()].push_back(book.getId());
+            authors[authorKey(book.getAuthor())].push_back(book.getId());
+            isbns.emplace_back(isbnKey(book.getIsbn()), book.getId());
+        }
+        for (auto &entry : byYear)
+            sort(entry.second.begin(), entry.second.end());
+        for (auto &entry : authors)
+        {
+            sort(entry.second.begin(), entry.second.end());
+            byAuthor.emplace(entry.first, move(entry.second));
+        }
+        if (deferSort)
+            pendingIsbns = move(isbns);
+        else
+            byIsbn.assign(isbns);
+    }
+
+    // Hold off sorting the ISBN index during a bulk load; lookups must wait
+    // until it is turned off again
+    void setDeferSort(bool defer)
+    {
+        if (deferSort && !defer)
+        {
+            // Each removal cancels one matching addition
+            sort(pendingIsbns.begin(), pendingIsbns.end());
+            sort(removedIsbns.begin(), removedIsbns.end());
+            vector<BlockedIndex::Entry> kept;
+            kept.reserve(pendingIsbns.size());
+            set_difference(make_move_iterator(pendingIsbns.begin()), make_move_iterator(pendingIsbns.end()),
+                           removedIsbns.begin(), removedIsbns.end(), back_inserter(kept));
+            byIsbn.assign(kept);
+            pendingIsbns = vector<BlockedIndex::Entry>();
+            removedIsbns = vector<BlockedIndex::Entry>();
+        }
+        deferSort = defer;
+    }
+
+    // Books published from one year to another, inclusive
+    vector<int> years(int from, int to) const
+    {
+        vector<int> ids;
+        for (auto it = byYear.lower_bound(from); it != byYear.end() && it->first <= to; ++it)
+            ids.insert(ids.end(), it->second.begin(), it->second.end());
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    vector<int> author(string_view name) const
+    {
+        auto it = byAuthor.find(authorKey(name));
+        return it == byAuthor.end() ? vector<int>() : it->second;
+    }
+
+    // Books whose ISBN equals isbn, or starts with it when prefix is set
+    vector<int> isbn(string_view isbn, bool prefix) const
+    {
+        string key = isbnKey(isbn);
+        vector<int> ids;
+        byIsbn.forEachFrom(BlockedIndex::Entry(key, numeric_limits<int>::min()), [&](const BlockedIndex::Entry &entry) {
+            if (prefix ? entry.first.compare(0, key.size(), key) != 0 : entry.first != key)
+                return false;
+            ids.push_back(entry.second);
+            return true;
+        });
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+};
+
+// Filters for Library::queryBooks. A book must pass every filter that is set,
+// and at least one of years, author and ISBN must be set.
+struct BookQuery
+{
+    bool byYear = false;
+    int yearFrom = 0;
+    int yearTo = 0;
+    string author; // empty for any author
+    string isbn;   // empty for any ISBN
+    bool isbnPrefix = false;
+    bool availableOnly = false;
+
+    bool hasIndexedFilter() const { return byYear || !author.empty() || !isbn.empty(); }
+};
+
+// Parse "1900-1950", "1958", "1900-" or "-1950" into an inclusive range
+static bool parseYearRange(string_view text, int &from, int &to)
+{
+    size_t dash = text.find('-');
+    if (dash == string_view::npos)
+        return parseNumber(text, from) && parseNumber(text, to);
+    string_view first = text.substr(0, dash), last = text.substr(dash + 1);
+    from = numeric_limits<int>::min();
+    to = numeric_limits<int>::max();
+    if (first.empty() && last.empty())
+        return false;
+    return (first.empty() || parseNumber(first, from)) && (last.empty() || parseNumber(last, to)) && from <= to;
+}
+
+// Set the ISBN filter from an ISBN, or from a prefix ending in '*'
+static bool parseIsbnFilter(string_view text, BookQuery &query)
+{
+    query.isbnPrefix = !text.empty() && text.back() == '*';
+    if (query.isbnPrefix)
+        text.remove_suffix(1);
+    query.isbn = string(text);
+    return !text.empty();
+}
+
+// Bitmap
+// Dense bitset over catalog slots with an O(1) population count. Set bits are
+// counted per stripe of words, matching Library's book lock shards, so that
+// bits under different shard locks can be updated concurrently.
+class Bitmap
+{
+private:
+    vector<uint64_t> words;
+    size_t bits;
+    atomic<size_t> stripeOnes[LOCK_SHARDS]; // set bits in words w with w % LOCK_SHARDS == stripe
+
+    static int lowestBit(uint64_t word)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return (int)index;
+#else
+        return __builtin_ctzll(word);
+#endif
+    }
+
+public:
+    Bitmap() : bits(0)
+    {
+        for (auto &ones : stripeOnes)
+            ones.store(0, memory_order_relaxed);
+    }
+
+    size_t size() const { return bits; }
+
+    size_t count() const
+    {
+        size_t ones = 0;
+        for (auto &stripe : stripeOnes)
+            ones += stripe.load(memory_order_relaxed);
+        return ones;
+    }
+
+    void resize(size_t n)
+    {
+        for (size_t i = n; i < bits; ++i)
+            assign(i, false);
+        bits = n;
+        words.resize((n + 63) / 64, 0);
+    }
+
+    bool test(size_t i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+
+    void assign(size_t i, bool value)
+    {
+        uint64_t &word = words[i >> 6];
+        uint64_t mask = 1ULL << (i & 63);
+        if (((word & mask) != 0) == value)
+            return;
+        word ^= mask;
+        atomic<size_t> &ones = stripeOnes[(i >> 6) % LOCK_SHARDS];
+        if (value)
+            ones.fetch_add(1, memory_order_relaxed);
+        else
+            ones.fetch_sub(1, memory_order_relaxed);
+    }
+
+    void clear()
+    {
+        words.clear();
+        bits = 0;
+        for (auto &ones : stripeOnes)
+            ones.store(0, memory_order_relaxed);
+    }
+
+    // Call fn(i) for every set bit in ascending order, until fn returns false
+    template <typename Fn>
+    void forEach(Fn fn) const
+    {
+        for (size_t w = 0; w < words.size(); ++w)
+        {
+            uint64_t word = words[w];
+            while (word)
+            {
+                if (!fn(w * 64 + lowestBit(word)))
+                    return;
+                word &= word - 1;
+            }
+        }
+    }
+};
+
+// Contiguous storage for the catalog; see "Book Store" above
+class BookStore
+{
+private:
+    vector<BookState> states;
+    vector<BookText> texts;
+    StringPool strings;
+    size_t deadBytes; // pool text no longer referenced, from replaced titles
+
+    // Move the text of the slots not marked in removed (all slots when
+    // removed is null) down and into a fresh pool
+    void rebuild(const Bitmap *removed)
+    {
+        StringPool fresh;
+        size_t kept = 0;
+        for (size_t i = 0; i < states.size(); ++i)
+        {
+            if (removed != nullptr && removed->test(i))
+                continue;
+            const BookText &text = texts[i];
+            states[kept] = states[i];
+            texts[kept] = BookText{fresh.add(strings.view(text.title)), fresh.intern(strings.view(text.author)),
+                                   fresh.intern(strings.view(text.publisher)), fresh.add(strings.view(text.isbn)), text.year};
+            ++kept;
+        }
+        states.resize(kept);
+        texts.resize(kept);
+        strings = move(fresh);
+        deadBytes = 0;
+    }
+
+public:
+    BookStore() : deadBytes(0) {}
+
+    size_t size() const { return states.size(); }
+
+    BookView operator[](size_t slot) const { return BookView(&states[slot], &texts[slot], &strings); }
+
+    void reserve(size_t n)
+    {
+        states.reserve(n);
+        texts.reserve(n);
+    }
+
+    void clear()
+    {
+        states.clear();
+        texts.clear();
+        strings = StringPool();
+        deadBytes = 0;
+    }
+
+    void push_back(const Book &book)
+    {
+        append(BookState{book.getId(), book.getReservedBy(), book.getStatus()}, book.getTitle(), book.getAuthor(),
+               book.getPublisher(), book.getIsbn(), book.getYear());
+    }
+
+    void append(const BookState &state, string_view title, string_view author, string_view publisher, string_view isbn,
+                int year)
+    {
+        states.push_back(state);
+        texts.push_back(BookText{strings.add(title), strings.intern(author), strings.intern(publisher), strings.add(isbn), year});
+    }
+
+    void setStatus(size_t slot, BookStatus status) { states[slot].status = status; }
+    void setReservedBy(size_t slot, int uid) { states[slot].reservedBy = uid; }
+
+    // The old title stays in the pool as garbage. Once garbage passes
+    // POOL_GARBAGE_MIN bytes and half the pool, the pool is rebuilt; views
+    // returned earlier are then invalid.
+    void setTitle(size_t slot, string_view title)
+    {
+        deadBytes += strings.view(texts[slot].title).size();
+        texts[slot].title = strings.add(title);
+        if (deadBytes >= POOL_GARBAGE_MIN && deadBytes * 2 > strings.bytes())
+            rebuild(nullptr);
+    }
+
+    // Drop the slots marked in removed, keeping the order of the rest, and
+    // rebuild the pool without their text or replaced titles
+    void compact(const Bitmap &removed) { rebuild(&removed); }
+};
+
+// Clock
+// Where the library reads the current time. Dashboards and commands ask
+// Library::now(), so a simulation can run on a calendar of its own instead of
+// waiting in real time.
+class Clock
+{
+public:
+    virtual ~Clock() {}
+    virtual time_t now() const = 0;
+};
+
+class SystemClock : public Clock
+{
+public:
+    time_t now() const override { return time(0); }
+};
+
+// A clock that only moves when it is set
+class ManualClock : public Clock
+{
+private:
+    time_t current;
+
+public:
+    explicit ManualClock(time_t start) : current(start) {}
+    time_t now() const override { return current; }
+    void set(time_t t) { current = t; }
+};
+
+// Forward Declaration of Library
+class Library;
+
+// Due Dates
+// Min-heap of open loans ordered by due date. The heap position of every
+// loan is indexed, so a return or a user removal takes the loan out directly
+// instead of leaving it to be skipped later.
+class DueQueue
+{
+public:
+    struct Entry
+    {
+        time_t due;
+        int userId;
+        int bookId;
+    };
+
+private:
+    vector<Entry> heap;
+    unordered_map<uint64_t, size_t> position; // (userId, bookId) -> index in heap
+
+    static uint64_t key(int userId, int bookId) { return ((uint64_t)(uint32_t)userId << 32) | (uint32_t)bookId; }
+
+    void place(size_t i, const Entry &entry)
+    {
+        heap[i] = entry;
+        position[key(entry.userId, entry.bookId)] = i;
+    }
+
+    void siftUp(size_t i)
+    {
+        Entry entry = heap[i];
+        while (i > 0 && entry.due < heap[(i - 1) / 2].due)
+        {
+            place(i, heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        place(i, entry);
+    }
+
+    void siftDown(size_t i)
+    {
+        Entry entry = heap[i];
+        while (true)
+        {
+            size_t child = 2 * i + 1;
+            if (child >= heap.size())
+                break;
+            if (child + 1 < heap.size() && heap[child + 1].due < heap[child].due)
+                ++child;
+            if (!(heap[child].due < entry.due))
+                break;
+            place(i, heap[child]);
+            i = child;
+        }
+        place(i, entry);
+    }
+
+public:
+    size_t size() const { return heap.size(); }
+
+    void clear()
+    {
+        heap.clear();
+        position.clear();
+    }
+
+    void push(time_t due, int userId, int bookId)
+    {
+        remove(userId, bookId);
+        heap.push_back(Entry{due, userId, bookId});
+        siftUp(heap.size() - 1);
+    }
+
+    bool remove(int userId, int bookId)
+    {
+        auto it = position.find(key(userId, bookId));
+        if (it == position.end())
+            return false;
+        size_t i = it->second;
+        position.erase(it);
+        Entry last = heap.back();
+        heap.pop_back();
+        if (i < heap.size())
+        {
+            place(i, last);
+            siftDown(i);
+            siftUp(position[key(last.userId, last.bookId)]);
+        }
+        return true;
+    }
+
+    // Call fn(entry) for every loan due before 'now'. Only the overdue part of
+    // the heap is visited; entries come out in no particular order.
+    template <typename Fn>
+    void forEachDueBefore(time_t now, Fn fn) const
+    {
+        vector<size_t> pending;
+        if (!heap.empty())
+            pending.push_back(0);
+        while (!pending.empty())
+        {
+            size_t i = pending.back();
+            pending.pop_back();
+            if (!(heap[i].due < now))
+                continue;
+            fn(heap[i]);
+            for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < heap.size(); ++child)
+                pending.push_back(child);
+        }
+    }
+};
+
+// Latency Histogram
+// Log-linear buckets in the style of HdrHistogram: values below 16 ns get a
+// bucket each, and every higher power of two is split into 16 sub-buckets,
+// so a percentile is reported within about 6% of the recorded value.
+// Recording is a handful of relaxed atomic adds, safe from any thread.
+class LatencyHistogram
+{
+private:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    atomic<uint64_t> counts[BUCKETS]{};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sum{0};
+    atomic<uint64_t> maximum{0};
+
+    static int highestBit(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return (int)index;
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    static int bucketOf(uint64_t ns)
+    {
+        if (ns < SUB_BUCKETS)
+            return (int)ns;
+        int shift = highestBit(ns) - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + (int)((ns >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that falls in bucket b
+    static uint64_t bucketTop(int b)
+    {
+        if (b < SUB_BUCKETS)
+            return b;
+        int shift = (b >> SUB_BITS) - 1;
+        uint64_t sub = b & (SUB_BUCKETS - 1);
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(uint64_t ns)
+    {
+        counts[bucketOf(ns)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(ns, memory_order_relaxed);
+        uint64_t seen = maximum.load(memory_order_relaxed);
+        while (ns > seen && !maximum.compare_exchange_weak(seen, ns, memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t maxValue() const { return maximum.load(memory_order_relaxed); }
+    double mean() const { return count() ? (double)sum.load(memory_order_relaxed) / count() : 0; }
+
+    // Value at or below which the given fraction of recordings fall
+    uint64_t percentile(double fraction) const
+    {
+        uint64_t n = count();
+        if (n == 0)
+            return 0;
+        uint64_t target = max<uint64_t>(1, (uint64_t)(fraction * n + 0.999999));
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b)
+        {
+            seen += counts[b].load(memory_order_relaxed);
+            if (seen >= target)
+                return min(bucketTop(b), maxValue());
+        }
+        return maxValue();
+    }
+};
+
+// Operations whose latency is recorded
+enum class Op : uint8_t
+{
+    Login,
+    Borrow,
+    Return,
+    Reserve,
+    PayFine,
+    AddBook,
+    RemoveBook,
+    UpdateBook,
+    AddUser,
+    RemoveUser,
+    Search,
+    Query,
+    Load,
+    Save,
+    Commit,
+    Checkpoint,
+    Count
+};
+
+static const char *toString(Op op)
+{
+    static const char *const names[] = {"login", "borrow", "return", "reserve", "pay_fine", "add_book", "remove_book",
+                                        "update_book", "add_user", "remove_user", "search", "query", "load", "save",
+                                        "commit", "checkpoint"};
+    return names[(size_t)op];
+}
+
+// One latency histogram per operation
+class OpStats
+{
+private:
+    LatencyHistogram histograms[(size_t)Op::Count];
+
+public:
+    void record(Op op, uint64_t ns) { histograms[(size_t)op].record(ns); }
+    const LatencyHistogram &get(Op op) const { return histograms[(size_t)op]; }
+};
+
+// Records the time from construction to destruction under one operation
+class ScopedTimer
+{
+private:
+    OpStats &stats;
+    Op op;
+    bool enabled;
+    chrono::steady_clock::time_point start;
+
+public:
+    ScopedTimer(OpStats &stats, Op op, bool enabled = true)
+        : stats(stats), op(op), enabled(enabled), start(chrono::steady_clock::now()) {}
+    ~ScopedTimer()
+    {
+        if (enabled)
+            stats.record(op, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+};
+
+// Book Handle
+// Refers to a book by ID and caches its slot in the library's catalog, so it
+// survives the vector reallocating. Slots only move when removed books are
+// compacted away; the handle then sees a new layout epoch and looks its book
+// up again. A handle to a book that has since been removed tests false.
+class BookHandle
+{
+private:
+    Library *lib;
+    int id;
+    mutable size_t slot;
+    mutable uint64_t epoch;
+
+    size_t resolve() const;
+
+public:
+    BookHandle() : lib(nullptr), id(0), slot(0), epoch(0) {}
+    BookHandle(Library *lib, int id, size_t slot, uint64_t epoch) : lib(lib), id(id), slot(slot), epoch(epoch) {}
+
+    explicit operator bool() const;
+    size_t getSlot() const { return resolve(); }
+    BookView operator->() const;
+    BookView operator*() const;
+};
+
+// User Base Class
+class User
+{
+private:
+    int id;
+    string username;
+    string password;
+    string name;
+    UserRole role;
+    Account account;
+
+public:
+    User() : id(0), role(UserRole::Student) {}
+    User(int id, string username, string password, string name, UserRole role)
+        : id(id), username(username), password(password), name(name), role(role) {}
+
+    int getId() const { return id; }
+    const string &getUsername() const { return username; }
+    const string &getPassword() const { return password; }
+    const string &getName() const { return name; }
+    UserRole getRole() const { return role; }
+    Account &getAccount() { return account; }
+    const Account &getAccount() const { return account; }
+
+    virtual void dashboard(Library &lib) = 0;
+    virtual ~User() {}
+};
+
+// Derived Classes
+class Student : public User
+{
+public:
+    Student(int id, string username, string password, string name)
+        : User(id, username, password, name, UserRole::Student) {}
+    void dashboard(Library &lib) override;
+};
+
+class Faculty : public User
+{
+public:
+    Faculty(int id, string username, string password, string name)
+        : User(id, username, password, name, UserRole::Faculty) {}
+    void dashboard(Library &lib) override;
+};
+
+class Librarian : public User
+{
+public:
+    Librarian(int id, string username, string password, string name)
+        : User(id, username, password, name, UserRole::Librarian) {}
+    void dashboard(Library &lib) override;
+};
+
+// Object Pool
+// Allocates objects of one type from contiguous chunks, which grow as the
+// pool does, and reuses the slots of destroyed objects. Users of one role
+// therefore sit next to each other in memory instead of in separate heap
+// blocks.
+template <typename T>
+class ObjectPool
+{
+private:
+    struct Slot
+    {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static constexpr size_t FIRST_CHUNK = 16;
+    static constexpr size_t MAX_CHUNK = 4096;
+
+    vector<unique_ptr<Slot[]>> chunks;
+    vector<T *> freeSlots;
+    size_t chunkSize;
+    size_t used; // slots handed out from the newest chunk
+
+public:
+    ObjectPool() : chunkSize(0), used(0) {}
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        void *slot;
+        if (!freeSlots.empty())
+        {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else
+        {
+            if (used == chunkSize)
+            {
+                chunkSize = chunkSize == 0 ? FIRST_CHUNK : min(chunkSize * 2, MAX_CHUNK);
+                chunks.emplace_back(new Slot[chunkSize]);
+                used = 0;
+            }
+            slot = chunks.back()[used++].storage;
+        }
+        return new (slot) T(forward<Args>(args)...);
+    }
+
+    void destroy(T *object)
+    {
+        object->~T();
+        freeSlots.push_back(object);
+    }
+};
+
+// Data File Parsing
+// Line parsers shared by the single-threaded and parallel loaders. Each returns
+// false and sets error for a malformed line.
+
+// A text field of a data file; escaped is false for files written before
+// fields were escaped
+static string fileField(string_view field, bool escaped)
+{
+    return escaped ? unescapeField(field) : string(field);
+}
+
+static bool parseBookLine(string_view line, bool escaped, Book &book, string &error)
+{
+    string_view f[8];
+    size_t n = splitFields(line, f, 8, escaped);
+    if (n != 7 && n != 8)
+    {
+        error = "expected 7 or 8 fields";
+        return false;
+    }
+    int id, year, reserved = -1;
+    if (!parseNumber(f[0], id) || !parseNumber(f[4], year) || (n == 8 && !parseNumber(f[7], reserved)))
+    {
+        error = "invalid number";
+        return false;
+    }
+    BookStatus status;
+    if (!parseBookStatus(f[6], status))
+    {
+        error = "unknown status";
+        return false;
+    }
+    book = Book(id, fileField(f[1], escaped), fileField(f[2], escaped), fileField(f[3], escaped), year,
+                fileField(f[5], escaped), status, reserved);
+    return true;
+}
+
+// One line of fines.txt: either a loan or a user's fine balance
+struct LoanLine
+{
+    int userId;
+    bool isFine;
+    bool isAccrued; // informational ACCRUED line written by the fine sweep
+    double fine;
+    BorrowRecord rec;
+};
+
+static bool parseLoanLine(string_view line, LoanLine &loan, string &error)
+{
+    string_view f[3];
+    if (splitFields(line, f, 3) != 3)
+    {
+        error = "expected 3 fields";
+        return false;
+    }
+    if (!parseNumber(f[0], loan.userId))
+    {
+        error = "invalid user ID";
+        return false;
+    }
+    loan.isFine = (f[1] == "FINE");
+    loan.isAccrued = (f[1] == "ACCRUED");
+    if (loan.isFine || loan.isAccrued)
+    {
+        if (!parseNumber(f[2], loan.fine))
+        {
+            error = "invalid fine amount";
+            return false;
+        }
+        return true;
+    }
+    long long borrowTime;
+    if (!parseNumber(f[1], loan.rec.bookId) || !parseNumber(f[2], borrowTime))
+    {
+        error = "invalid book ID or borrow time";
+        return false;
+    }
+    loan.rec.borrowTime = (time_t)borrowTime;
+    return true;
+}
+
+static unsigned loadThreadCount()
+{
+    unsigned n = thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Split text into at most 'parts' consecutive chunks, each ending on a line boundary
+static vector<string_view> splitChunks(string_view text, size_t parts)
+{
+    vector<string_view> chunks;
+    size_t target = text.size() / parts + 1;
+    while (!text.empty())
+    {
+        size_t end = text.size() <= target ? string_view::npos : text.find('\n', target);
+        size_t len = (end == string_view::npos) ? text.size() : end + 1;
+        chunks.push_back(text.substr(0, len));
+        text.remove_prefix(len);
+    }
+    return chunks;
+}
+
+// Run fn(i) for every i in [0, count) on its own thread and wait for all of them
+template <typename Fn>
+static void runParallel(size_t count, Fn fn)
+{
+    vector<thread> workers;
+    workers.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        workers.emplace_back(fn, i);
+    for (auto &w : workers)
+        w.join();
+}
+
+// Report output: aligned text for people, or TSV / JSON lines for tools
+enum class ReportFormat : uint8_t
+{
+    Text,
+    Tsv,
+    JsonLines
+};
+
+struct ReportOptions
+{
+    ReportFormat format = ReportFormat::Text;
+    size_t pageSize = 0; // rows per page; 0 shows every row at once
+    size_t offset = 0;   // rows skipped before the first page
+};
+
+// One user flagged by the fine sweep: a student with accrued fines or a
+// faculty member who is blocked from borrowing
+struct SweepRow
+{
+    const User *user;
+    int overdueLoans;
+    double accrued;
+    bool blocked;
+};
+
+struct SweepResult
+{
+    vector<SweepRow> rows;
+    size_t users = 0;
+    size_t openLoans = 0;
+    size_t overdueLoans = 0;
+    size_t studentsAccruing = 0;
+    size_t facultyBlocked = 0;
+    double accrued = 0;
+    double billed = 0;
+};
+
+// Report
+// Renders one page of a listing into a single buffer that is written to
+// stdout in one call, instead of flushing the stream after every row.
+class Report
+{
+private:
+    string out;
+    ReportFormat format;
+    size_t first;
+    size_t limit;
+    size_t seen;
+    size_t shown;
+
+    // Decide whether the next row falls on this page
+    bool take()
+    {
+        bool show = seen >= first && shown < limit;
+        ++seen;
+        if (show)
+            ++shown;
+        return show;
+    }
+
+    void tsvField(string_view value, char end)
+    {
+        for (char c : value)
+            out += (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
+        out += end;
+    }
+
+    void jsonField(const char *key, string_view value, bool last = false)
+    {
+        out += '"';
+        out += key;
+        out += "\":\"";
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)c);
+                out += esc;
+            }
+            else
+                out += c;
+        }
+        out += last ? "\"}\n" : "\",";
+    }
+
+    void jsonField(const char *key, long long value, bool last = false)
+    {
+        out += '"';
+        out += key;
+        out += "\":";
+        out += to_string(value);
+        out += last ? "}\n" : ",";
+    }
+
+public:
+    Report(ReportFormat format, size_t first, size_t limit)
+        : format(format), first(first), limit(limit), seen(0), shown(0) {}
+
+    // True once this page is full, so callers can stop producing rows
+    bool full() const { return shown >= limit; }
+    size_t rowsShown() const { return shown; }
+    size_t firstRow() const { return first; }
+
+    // Free-form text such as headings; only used in text format
+    void text(const string &line)
+    {
+        if (format == ReportFormat::Text)
+            out += line;
+    }
+
+    // Column header line for TSV output
+    void tsvHeader(const string &header)
+    {
+        if (format == ReportFormat::Tsv)
+            out += header;
+    }
+
+    void addBook(const BookView &book)
+    {
+        if (!take())
+            return;
+        if (format == ReportFormat::Text)
+            book.display(out);
+        else if (format == ReportFormat::Tsv)
+        {
+            tsvField(to_string(book.getId()), '\t');
+            tsvField(book.getTitle(), '\t');
+            tsvField(book.getAuthor(), '\t');
+            tsvField(book.getPublisher(), '\t');
+            tsvField(to_string(book.getYear()), '\t');
+            tsvField(book.getIsbn(), '\t');
+            tsvField(toString(book.getStatus()), '\t');
+            tsvField(to_string(book.getReservedBy()), '\n');
+        }
+        else
+        {
+            out += '{';
+            jsonField("id", book.getId());
+            jsonField("title", book.getTitle());
+            jsonField("author", book.getAuthor());
+            jsonField("publisher", book.getPublisher());
+            jsonField("year", book.getYear());
+            jsonField("isbn", book.getIsbn());
+            jsonField("status", toString(book.getStatus()));
+            jsonField("reservedBy", book.getReservedBy(), true);
+        }
+    }
+
+    void addUser(const User &user)
+    {
+        if (!take())
+            return;
+        if (format == ReportFormat::Text)
+        {
+            out += to_string(user.getId());
+            out += " - ";
+            out += user.getUsername();
+            out += " (";
+            out += toString(user.getRole());
+            out += ") - ";
+            out += user.getName();
+            out += '\n';
+        }
+        else if (format == ReportFormat::Tsv)
+        {
+            tsvField(to_string(user.getId()), '\t');
+            tsvField(user.getUsername(), '\t');
+            tsvField(toString(user.getRole()), '\t');
+            tsvField(user.getName(), '\n');
+        }
+        else
+        {
+            out += '{';
+            jsonField("id", user.getId());
+            jsonField("username", user.getUsername());
+            jsonField("role", toString(user.getRole()));
+            jsonField("name", user.getName(), true);
+        }
+    }
+
+    void addSweepRow(const SweepRow &row)
+    {
+        if (!take())
+            return;
+        const User &user = *row.user;
+        if (format == ReportFormat::Text)
+        {
+            ostringstream line;
+            line << user.getId() << " - " << user.getName() << " (" << user.getRole() << "): " << row.overdueLoans
+                 << " overdue loans, ";
+            if (user.getRole() == UserRole::Student)
+                line << row.accrued << " rupees accrued\n";
+            else
+                line << "blocked from borrowing\n";
+            out += line.str();
+        }
+        else if (format == ReportFormat::Tsv)
+        {
+            ostringstream accrued;
+            accrued << row.accrued;
+            tsvField(to_string(user.getId()), '\t');
+            tsvField(user.getName(), '\t');
+            tsvField(toString(user.getRole()), '\t');
+            tsvField(to_string(row.overdueLoans), '\t');
+            tsvField(accrued.str(), '\t');
+            tsvField(row.blocked ? "1" : "0", '\n');
+        }
+        else
+        {
+            ostringstream accrued;
+            accrued << row.accrued;
+            out += '{';
+            jsonField("id", user.getId());
+            jsonField("name", user.getName());
+            jsonField("role", toString(user.getRole()));
+            jsonField("overdueLoans", row.overdueLoans);
+            out += "\"accrued\":" + accrued.str() + ",";
+            jsonField("blocked", row.blocked ? 1 : 0, true);
+        }
+    }
+
+    void addLoan(const User &user, const BookView *book, int bookId, time_t due, int overdueDays)
+    {
+        if (!take())
+            return;
+        string_view title = book ? book->getTitle() : string_view();
+        if (format == ReportFormat::Text)
+        {
+            out += "Book ID: ";
+            out += to_string(bookId);
+            if (book)
+            {
+                out += " (";
+                out += title;
+                out += ')';
+            }
+            out += " borrowed by ";
+            out += to_string(user.getId());
+            out += " - ";
+            out += user.getName();
+            out += ", overdue by ";
+            out += to_string(overdueDays);
+            out += " days\n";
+        }
+        else if (format == ReportFormat::Tsv)
+        {
+            tsvField(to_string(user.getId()), '\t');
+            tsvField(user.getName(), '\t');
+            tsvField(to_string(bookId), '\t');
+            tsvField(title, '\t');
+            tsvField(to_string((long long)due), '\t');
+            tsvField(to_string(overdueDays), '\n');
+        }
+        else
+        {
+            out += '{';
+            jsonField("userId", user.getId());
+            jsonField("name", user.getName());
+            jsonField("bookId", bookId);
+            jsonField("title", title);
+            jsonField("due", (long long)due);
+            jsonField("overdueDays", overdueDays, true);
+        }
+    }
+
+    void addStat(Op op, const LatencyHistogram &h)
+    {
+        if (!take())
+            return;
+        double p50 = h.percentile(0.50) / 1000.0, p99 = h.percentile(0.99) / 1000.0;
+        double worst = h.maxValue() / 1000.0, mean = h.mean() / 1000.0;
+        if (format == ReportFormat::Text)
+        {
+            char line[160];
+            snprintf(line, sizeof(line), "%-12s %10llu %12.1f %12.1f %12.1f %12.1f\n", toString(op),
+                     (unsigned long long)h.count(), p50, p99, worst, mean);
+            out += line;
+        }
+        else if (format == ReportFormat::Tsv)
+        {
+            char line[160];
+            snprintf(line, sizeof(line), "%s\t%llu\t%.1f\t%.1f\t%.1f\t%.1f\n", toString(op),
+                     (unsigned long long)h.count(), p50, p99, worst, mean);
+            out += line;
+        }
+        else
+        {
+            char line[200];
+            snprintf(line, sizeof(line),
+                     "{\"operation\":\"%s\",\"count\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"mean_us\":%.1f}\n",
+                     toString(op), (unsigned long long)h.count(), p50, p99, worst, mean);
+            out += line;
+        }
+    }
+
+    void flush(ostream &os = cout)
+    {
+        os.write(out.data(), out.size());
+        os.flush();
+        out.clear();
+    }
+};
+
+// Outcome of a circulation request, shared by the dashboards and batch mode
+enum class CircResult : uint8_t
+{
+    Ok,
+    BookNotFound,
+    UserNotFound,
+    NotAvailable,
+    LimitReached,
+    OutstandingFine,
+    OverdueBlocked,
+    NotBorrowed,
+    AlreadyReserved,
+    NoNeedToReserve,
+    NoFine,
+    NotAllowed
+};
+
+static const char *describe(CircResult result)
+{
+    switch (result)
+    {
+    case CircResult::Ok:
+        return "OK.";
+    case CircResult::BookNotFound:
+        return "Book not found.";
+    case CircResult::UserNotFound:
+        return "User not found.";
+    case CircResult::NotAvailable:
+        return "Book is not available for borrowing.";
+    case CircResult::LimitReached:
+        return "Borrowing limit reached.";
+    case CircResult::OutstandingFine:
+        return "Outstanding fine. Please clear your fine before borrowing.";
+    case CircResult::OverdueBlocked:
+        return "One of your loans is overdue by more than 60 days. Cannot borrow new books.";
+    case CircResult::NotBorrowed:
+        return "Book not found in your borrowed list.";
+    case CircResult::AlreadyReserved:
+        return "Book is already reserved.";
+    case CircResult::NoNeedToReserve:
+        return "Book is available. No need to reserve.";
+    case CircResult::NoFine:
+        return "No fine to pay.";
+    default:
+        return "This operation is not available for your role.";
+    }
+}
+
+// Details of a completed return
+struct ReturnInfo
+{
+    bool late;
+    int overdueDays;
+    double fine;
+};
+
+static const char *BOOK_TSV_HEADER = "id\ttitle\tauthor\tpublisher\tyear\tisbn\tstatus\treservedBy\n";
+static const char *USER_TSV_HEADER = "id\tusername\trole\tname\n";
+static const char *SWEEP_TSV_HEADER = "id\tname\trole\toverdueLoans\taccrued\tblocked\n";
+static const char *STATS_TSV_HEADER = "operation\tcount\tp50_us\tp99_us\tmax_us\tmean_us\n";
+static const char *STATS_TEXT_HEADER = "Operation         Count    p50 (us)     p99 (us)     max (us)    mean (us)\n";
+static const char *LOAN_TSV_HEADER = "userId\tname\tbookId\ttitle\tdue\toverdueDays\n";
+
+// Library Class
+class Library
+{
+private:
+    BookStore books;
+    vector<User *> users;
+
+    // Storage for the users, one pool per role
+    ObjectPool<Student> studentPool;
+    ObjectPool<Faculty> facultyPool;
+    ObjectPool<Librarian> librarianPool;
+
+    // Lookup indexes, kept in sync by every add/remove below
+    unordered_map<int, size_t> bookIndex;          // book id -> slot in books
+    unordered_map<int, User *> userIndex;          // user id -> user
+    unordered_multimap<string, User *> usernameIndex; // username -> users; older data may repeat names
+    SearchIndex searchIndex;                       // words of title/author/publisher -> book ids
+    CatalogIndex catalogIndex;                     // year, author and ISBN -> book ids
+
+    // Availability bitmaps over book slots, and the books each user has reserved.
+    // Book status and reservations must only change through setBookStatus and
+    // setReservation so these stay in sync.
+    Bitmap availableBits;
+    Bitmap reservedBits;
+    unordered_map<int, vector<int>> reservationsByUser;
+
+    // Removed books stay in their slot as tombstones until compactBooks();
+    // layoutEpoch changes whenever slots move, so BookHandles re-resolve
+    Bitmap removedBits;
+    size_t removedCount;
+    uint64_t layoutEpoch;
+
+    // Every open loan by due date, and by book, kept by borrowBook/returnBook/
+    // removeUser; both are guarded by loanLock
+    DueQueue dueDates;
+    unordered_map<int, Borrower> loansByBook;
+
+    // Latency of the user-facing operations and of the disk work behind them
+    mutable OpStats stats;
+
+    // Accrued fines from the last sweep, written to fines.txt as ACCRUED lines
+    // by the next save only
+    unordered_map<int, double> accrualSnapshot;
+
+    // Write-ahead journal: every mutation appends one record to journal.txt,
+    // and a checkpoint folds the journal into the snapshot files
+    bool journalEnabled;
+    bool journalPaused;
+    int journalRecords;
+    FILE *journal;
+
+    // How listings are paginated and formatted
+    ReportOptions reportOptions;
+
+    // Time source for the dashboards and commands; the system clock unless replaced
+    SystemClock systemClock;
+    const Clock *clock;
+
+    // Snapshot format: data/library.bin when set, the three text files otherwise
+    bool binaryFormat;
+
+    // Generation of the last committed snapshot, from data/manifest.txt. The
+    // journal records the generation it applies on top of in its first line.
+    uint64_t generation;
+
+    // Format of the last committed snapshot, "text" or "binary", from the
+    // manifest; empty if the manifest names none
+    string committedFormat;
+
+    // Text snapshot files written with escaped fields, as listed in the
+    // manifest. Older files are read literally until they are next rewritten.
+    vector<string> escapedFiles;
+
+    // Directory holding the snapshot files and the journal
+    string dataDir;
+
+    // Snapshot files whose contents no longer match memory
+    atomic<bool> booksDirty;
+    atomic<bool> usersDirty;
+    atomic<bool> loansDirty;
+
+    // Background writer, see startWriter(). flush requests are numbered so a
+    // caller can wait for a writer pass that started after its request.
+    thread writer;
+    mutex writerLock;
+    condition_variable writerWake;
+    condition_variable writerPassDone;
+    bool writerStop;
+    uint64_t flushRequests;
+    uint64_t flushesServed;
+
+    // Mutations applied in memory but not yet durable
+    string pendingJournal;
+    int pendingMutations;
+    chrono::steady_clock::time_point firstPending;
+
+    // Locking, for concurrent server sessions. Adding or removing books and
+    // users takes catalogLock exclusively; circulation takes it shared plus
+    // the shard locks of the one user and one book involved, always in the
+    // order catalog, user, book, reservation, loans, journal. Book shards are picked
+    // by bitmap word so availability bits never share a word across shards.
+    // commit() and checkpoint() must be called with none of these held.
+    mutable shared_mutex catalogLock;
+    mutable mutex userLocks[LOCK_SHARDS];
+    mutable mutex bookLocks[LOCK_SHARDS];
+    mutex reservationLock;
+    mutable mutex loanLock;
+    mutex journalLock;
+    mutex commitLock;
+
+    mutex &userLock(int uid) const { return userLocks[(unsigned)uid % LOCK_SHARDS]; }
+    mutex &bookLock(size_t slot) const { return bookLocks[(slot >> 6) % LOCK_SHARDS]; }
+
+    // Create a user of the given role
+    User *newUser(UserRole role, int id, const string &username, const string &password, const string &name)
+    {
+        switch (role)
+        {
+        case UserRole::Faculty:
+            return facultyPool.create(id, username, password, name);
+        case UserRole::Librarian:
+            return librarianPool.create(id, username, password, name);
+        default:
+            return studentPool.create(id, username, password, name);
+        }
+    }
+
+    void destroyUser(User *user)
+    {
+        switch (user->getRole())
+        {
+        case UserRole::Faculty:
+            facultyPool.destroy(static_cast<Faculty *>(user));
+            break;
+        case UserRole::Librarian:
+            librarianPool.destroy(static_cast<Librarian *>(user));
+            break;
+        default:
+            studentPool.destroy(static_cast<Student *>(user));
+            break;
+        }
+    }
+
+    // Drop all books and users
+    void clear()
+    {
+        for (auto u : users)
+            destroyUser(u);
+        users.clear();
+        books.clear();
+        bookIndex.clear();
+        searchIndex.clear();
+        catalogIndex.clear();
+        availableBits.clear();
+        reservedBits.clear();
+        removedBits.clear();
+        removedCount = 0;
+        ++layoutEpoch;
+        reservationsByUser.clear();
+        dueDates.clear();
+        loansByBook.clear();
+        userIndex.clear();
+        usernameIndex.clear();
+    }
+
+    // Re-point the index entries and availability bits of every book at or after 'from'
+    void reindexBooks(size_t from)
+    {
+        availableBits.resize(books.size());
+        reservedBits.resize(books.size());
+        removedBits.resize(books.size());
+        for (size_t i = from; i < books.size(); ++i)
+        {
+            bookIndex[books[i].getId()] = i;
+            availableBits.assign(i, books[i].getStatus() == BookStatus::Available);
+            reservedBits.assign(i, books[i].getStatus() == BookStatus::Reserved);
+        }
+    }
+
+    // Drop the tombstones of removed books, moving the remaining books down
+    void compactBooks()
+    {
+        if (removedCount == 0)
+            return;
+        books.compact(removedBits);
+        removedBits.clear();
+        removedCount = 0;
+        reindexBooks(0);
+        ++layoutEpoch;
+    }
+
+    // Close the open loan of a book that is being removed. The borrower is not
+    // charged for it.
+    bool closeLoanOf(int bid)
+    {
+        auto it = loansByBook.find(bid);
+        if (it == loansByBook.end())
+            return false;
+        User *user = findUserById(it->second.userId);
+        if (user != nullptr)
+            user->getAccount().removeRecord(bid);
+        dueDates.remove(it->second.userId, bid);
+        loansByBook.erase(it);
+        return true;
+    }
+
+    void setBookStatus(size_t slot, BookStatus status)
+    {
+        books.setStatus(slot, status);
+        availableBits.assign(slot, status == BookStatus::Available);
+        reservedBits.assign(slot, status == BookStatus::Reserved);
+    }
+
+    // Reserve the book in slot for uid, or clear its reservation when uid is -1
+    void setReservation(size_t slot, int uid)
+    {
+        BookView book = books[slot];
+        int previous = book.getReservedBy();
+        if (previous == uid)
+            return;
+        lock_guard<mutex> lock(reservationLock);
+        if (previous != -1)
+        {
+            auto it = reservationsByUser.find(previous);
+            if (it != reservationsByUser.end())
+            {
+                vector<int> &ids = it->second;
+                ids.erase(find(ids.begin(), ids.end(), book.getId()));
+                if (ids.empty())
+                    reservationsByUser.erase(it);
+            }
+        }
+        books.setReservedBy(slot, uid);
+        if (uid != -1)
+            reservationsByUser[uid].push_back(book.getId());
+    }
+
+    // Queue a single mutation for the next group commit, either as a journal
+    // record or (with the journal disabled) as a rewrite of the dirty files
+    void logMutation(const string &record)
+    {
+        if (journalPaused)
+            return;
+        lock_guard<mutex> lock(journalLock);
+        if (journalEnabled)
+        {
+            pendingJournal += record;
+            pendingJournal += '\n';
+        }
+        if (pendingMutations++ == 0)
+            firstPending = chrono::steady_clock::now();
+    }
+
+    // Head an empty journal with the snapshot generation it applies on top of
+    void startJournal()
+    {
+        fprintf(journal, "GEN,%llu\n", (unsigned long long)generation);
+        if (!syncFile(journal))
+            cout << "Error: Cannot flush journal.txt to disk.\n";
+    }
+
+    // Write the pending journal records; the caller holds commitLock.
+    // Returns true when a checkpoint is due.
+    bool flushPending()
+    {
+        if (unwrittenMutations() == 0)
+            return false;
+        if (journalEnabled && journal == nullptr)
+        {
+            journal = fopen(dataPath("journal.txt").c_str(), "a");
+            if (journal == nullptr)
+            {
+                cout << "Error: Cannot open journal.txt for writing.\n";
+                return false;
+            }
+            fseek(journal, 0, SEEK_END);
+            if (ftell(journal) == 0)
+                startJournal();
+        }
+        string records;
+        int count;
+        {
+            lock_guard<mutex> lock(journalLock);
+            if (pendingMutations == 0)
+                return false;
+            records.swap(pendingJournal);
+            count = pendingMutations;
+            pendingMutations = 0;
+        }
+        // Without a journal the changes only become durable by rewriting the snapshot
+        if (!journalEnabled)
+            return true;
+        fwrite(records.data(), 1, records.size(), journal);
+        if (!syncFile(journal))
+            cout << "Error: Cannot flush journal.txt to disk.\n";
+        journalRecords += count;
+        return journalRecords >= JOURNAL_CHECKPOINT_INTERVAL;
+    }
+
+    static int loanPeriod(UserRole role) { return role == UserRole::Student ? STUDENT_BORROW_PERIOD : FACULTY_BORROW_PERIOD; }
+
+    static time_t dueDate(UserRole role, time_t borrowTime) { return borrowTime + (time_t)loanPeriod(role) * SECONDS_PER_DAY; }
+
+    // Rebuild the due-date queue and the loans by book from the accounts after
+    // loading. If two accounts hold the same book, the first one is indexed and
+    // checkConsistency() drops the other.
+    void rebuildLoanIndexes()
+    {
+        dueDates.clear();
+        loansByBook.clear();
+        for (auto user : users)
+        {
+            for (auto &rec : user->getAccount().getRecords())
+            {
+                dueDates.push(dueDate(user->getRole(), rec.borrowTime), user->getId(), rec.bookId);
+                loansByBook.emplace(rec.bookId, Borrower{user->getId(), rec.borrowTime});
+            }
+        }
+    }
+
+    // Reconcile the loaded state: drop loans of books that do not exist and
+    // second loans of a book already on loan, then make every book Borrowed
+    // exactly when someone holds it. Runs in O(books + loans).
+    void checkConsistency()
+    {
+        size_t droppedLoans = 0, fixedBooks = 0;
+        for (auto user : users)
+        {
+            vector<int> stray;
+            for (auto &rec : user->getAccount().getRecords())
+            {
+                auto it = loansByBook.find(rec.bookId);
+                if (!bookExists(rec.bookId) || it == loansByBook.end() || it->second.userId != user->getId())
+                    stray.push_back(rec.bookId);
+            }
+            for (int bid : stray)
+            {
+                user->getAccount().removeRecord(bid);
+                dueDates.remove(user->getId(), bid);
+                auto it = loansByBook.find(bid);
+                if (it != loansByBook.end() && it->second.userId == user->getId())
+                    loansByBook.erase(it);
+                cout << "Warning: dropped loan of missing or already borrowed book " << bid << " from user "
+                     << user->getId() << "\n";
+                ++droppedLoans;
+            }
+        }
+        for (size_t slot = 0; slot < books.size(); ++slot)
+        {
+            if (removedBits.test(slot))
+                continue;
+            BookView book = books[slot];
+            bool held = loansByBook.count(book.getId()) != 0;
+            if (held && book.getStatus() != BookStatus::Borrowed)
+                setBookStatus(slot, BookStatus::Borrowed);
+            else if (!held && book.getStatus() == BookStatus::Borrowed)
+                setBookStatus(slot, book.getReservedBy() != -1 ? BookStatus::Reserved : BookStatus::Available);
+            else
+                continue;
+            cout << "Warning: book " << book.getId() << " status corrected to " << book.getStatus() << "\n";
+            ++fixedBooks;
+        }
+        if (droppedLoans > 0)
+            loansDirty = true;
+        if (fixedBooks > 0)
+            booksDirty = true;
+    }
+
+    // Whether user may borrow right now; the caller holds the user's lock
+    CircResult borrowRule(const User *user, time_t now) const
+    {
+        const Account &account = user->getAccount();
+        if (user->getRole() == UserRole::Student)
+        {
+            if (account.getRecords().size() >= STUDENT_MAX_BORROW)
+                return CircResult::LimitReached;
+            if (account.getFine() > 0)
+                return CircResult::OutstandingFine;
+            return CircResult::Ok;
+        }
+        if (user->getRole() == UserRole::Faculty)
+        {
+            if (!account.getRecords().empty() && daysBetween(account.getOldestBorrowTime(), now) > FACULTY_OVERDUE_LIMIT)
+                return CircResult::OverdueBlocked;
+            if (account.getRecords().size() >= FACULTY_MAX_BORROW)
+                return CircResult::LimitReached;
+            return CircResult::Ok;
+        }
+        return CircResult::NotAllowed;
+    }
+
+    // Apply one journal record; returns false if the record is malformed
+    bool replayRecord(string_view line)
+    {
+        string_view f[7];
+        size_t n = splitFields(line, f, 7);
+        string_view op = f[0];
+        int id;
+        if (n < 2 || n > 7 || !parseNumber(f[1], id))
+            return false;
+        if (op == "ADDBOOK")
+        {
+            int year;
+            if (n != 7 || !parseNumber(f[5], year))
+                return false;
+            addBook(Book(id, unescapeField(f[2]), unescapeField(f[3]), unescapeField(f[4]), year, unescapeField(f[6])));
+            return true;
+        }
+        if (op == "REMOVEBOOK" && n == 2)
+        {
+            removeBook(id);
+            return true;
+        }
+        if (op == "TITLE" && n >= 3)
+        {
+            // The title is the rest of the line; older journals did not escape its commas
+            updateBookTitle(id, unescapeField(line.substr(f[2].data() - line.data())));
+            return true;
+        }
+        if (op == "ADDUSER")
+        {
+            UserRole role;
+            if (n != 6 || !parseUserRole(f[4], role))
+                return false;
+            addUser(role, id, unescapeField(f[2]), unescapeField(f[3]), unescapeField(f[5]));
+            return true;
+        }
+        if (op == "REMOVEUSER" && n == 2)
+        {
+            removeUser(id);
+            return true;
+        }
+
+        // Circulation records; check the whole record before looking up the user
+        int bid = 0;
+        long long borrowTime = 0;
+        double fine = 0;
+        bool valid;
+        if (op == "BORROW")
+            valid = n == 4 && parseNumber(f[2], bid) && parseNumber(f[3], borrowTime);
+        else if (op == "RETURN")
+            valid = n == 4 && parseNumber(f[2], bid) && parseNumber(f[3], fine);
+        else if (op == "RESERVE")
+            valid = n == 3 && parseNumber(f[2], bid);
+        else
+            valid = op == "PAYFINE" && n == 2;
+        if (!valid)
+            return false;
+        User *user = findUserById(id);
+        if (user == nullptr)
+            return true; // user removed later in the journal; nothing to apply
+        if (op == "BORROW")
+            borrowBook(user, bid, (time_t)borrowTime);
+        else if (op == "RETURN")
+            returnBook(user, bid, fine);
+        else if (op == "RESERVE")
+            reserveBook(user, bid);
+        else
+            payFine(user);
+        return true;
+    }
+
+    void replayJournal()
+    {
+        ifstream jfile(dataPath("journal.txt"));
+        if (!jfile)
+            return;
+        string line;
+        int lineNo = 0;
+        while (getline(jfile, line))
+        {
+            ++lineNo;
+            if (line.empty())
+                continue;
+            // A journal older than the snapshot was already folded into it by a
+            // checkpoint that stopped before truncating the journal
+            if (lineNo == 1 && line.compare(0, 4, "GEN,") == 0)
+            {
+                if (strtoull(line.c_str() + 4, nullptr, 10) < generation)
+                {
+                    cout << "journal.txt predates the current snapshot. Discarding it.\n";
+                    jfile.close();
+                    remove(dataPath("journal.txt").c_str());
+                    return;
+                }
+                continue;
+            }
+            if (!replayRecord(line))
+            {
+                // A torn write can only affect the tail; stop at the first bad record
+                cout << "Warning: journal.txt line " << lineNo << " is malformed. Ignoring the rest of the journal.\n";
+                break;
+            }
+            ++journalRecords;
+        }
+        jfile.close();
+    }
+
+    // Contents of the three text snapshot files. Each is formatted into one
+    // buffer so it can be written and synced in a single call.
+    string bookFileText() const
+    {
+        string text;
+        text.reserve(bookCount() * 96);
+        for (size_t i = 0; i < books.size(); ++i)
+        {
+            if (removedBits.test(i))
+                continue;
+            BookView book = books[i];
+            appendNumber(text, book.getId());
+            appendField(text += ',', book.getTitle());
+            appendField(text += ',', book.getAuthor());
+            appendField(text += ',', book.getPublisher());
+            text += ',';
+            appendNumber(text, book.getYear());
+            appendField(text += ',', book.getIsbn());
+            (text += ',') += toString(book.getStatus());
+            text += ',';
+            appendNumber(text, book.getReservedBy());
+            text += '\n';
+        }
+        return text;
+    }
+
+    string userFileText() const
+    {
+        string text;
+        text.reserve(users.size() * 64);
+        for (auto user : users)
+        {
+            appendNumber(text, user->getId());
+            appendField(text += ',', user->getUsername());
+            appendField(text += ',', user->getPassword());
+            (text += ',') += toString(user->getRole());
+            appendField(text += ',', user->getName());
+            text += '\n';
+        }
+        return text;
+    }
+
+    // Borrow records and fines, plus the accrued fines from the last sweep
+    string loanFileText() const
+    {
+        string text;
+        text.reserve(users.size() * 48);
+        for (auto user : users)
+        {
+            for (auto &rec : user->getAccount().getRecords())
+            {
+                appendNumber(text, user->getId());
+                text += ',';
+                appendNumber(text, rec.bookId);
+                text += ',';
+                appendNumber(text, rec.borrowTime);
+                text += '\n';
+            }
+            appendNumber(text, user->getId());
+            ((text += ",FINE,") += formatAmount(user->getAccount().getFine())) += '\n';
+            auto accrued = accrualSnapshot.find(user->getId());
+            if (accrued != accrualSnapshot.end())
+            {
+                appendNumber(text, user->getId());
+                ((text += ",ACCRUED,") += formatAmount(accrued->second)) += '\n';
+            }
+        }
+        return text;
+    }
+
+    static void appendNumber(string &text, long long value)
+    {
+        char buffer[24];
+        text.append(buffer, to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+    }
+
+    // An amount as ostream prints a double by default
+    static string formatAmount(double amount)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%g", amount);
+        return buffer;
+    }
+
+    // Atomically replace snapshot files with new contents. Each file is written
+    // and synced as "<name>.<next generation>"; then manifest.txt is replaced
+    // with one naming that generation and its files, which is the commit
+    // point; then the files are renamed into place. recoverSnapshot() redoes
+    // the renames if a crash interrupts them.
+    bool commitSnapshot(const vector<pair<const char *, string>> &files)
+    {
+        string suffix = "." + to_string(generation + 1);
+        string format = binaryFormat ? "binary" : "text";
+        string manifest = "generation " + to_string(generation + 1) + "\nformat " + format + "\n";
+        vector<string> escaped = escapedFiles;
+        for (auto &file : files)
+        {
+            if (!writeFileDurably(dataPath(file.first) + suffix, file.second))
+            {
+                cout << "Error: Cannot write " << file.first << suffix << ".\n";
+                return false;
+            }
+            manifest += "pending " + string(file.first) + "\n";
+            if (!binaryFormat && !isEscaped(file.first))
+                escaped.push_back(file.first);
+        }
+        for (auto &name : escaped)
+            manifest += "escaped " + name + "\n";
+        if (!writeFileDurably(dataPath("manifest.txt") + suffix, manifest) ||
+            !replaceFile(dataPath("manifest.txt") + suffix, dataPath("manifest.txt")) || !syncDirectory(dataDir))
+        {
+            cout << "Error: Cannot commit manifest.txt.\n";
+            return false;
+        }
+        ++generation;
+        escapedFiles = escaped;
+        committedFormat = format;
+        for (auto &file : files)
+        {
+            if (!replaceFile(dataPath(file.first) + suffix, dataPath(file.first)))
+                cout << "Error: Cannot rename " << file.first << suffix << ". It will be retried on the next start.\n";
+        }
+        if (!syncDirectory(dataDir))
+            cout << "Error: Cannot flush " << dataDir << " to disk.\n";
+        return true;
+    }
+
+    // Bring the data files to the last committed snapshot: finish the renames
+    // of its files and discard files written for a commit that never happened
+    void recoverSnapshot()
+    {
+        generation = 0;
+        escapedFiles.clear();
+        committedFormat.clear();
+        vector<string> pending;
+        ifstream manifest(dataPath("manifest.txt"));
+        string key, value;
+        while (manifest >> key >> value)
+        {
+            if (key == "generation")
+                generation = strtoull(value.c_str(), nullptr, 10);
+            else if (key == "pending")
+                pending.push_back(value);
+            else if (key == "escaped")
+                escapedFiles.push_back(value);
+            else if (key == "format")
+                committedFormat = value;
+        }
+        manifest.close();
+        string suffix = "." + to_string(generation);
+        for (const char *name : SNAPSHOT_FILES)
+        {
+            bool listed = find(pending.begin(), pending.end(), name) != pending.end();
+            string temp = dataPath(name) + suffix;
+            if (listed && fileExists(temp) && !replaceFile(temp, dataPath(name)))
+                cout << "Error: Cannot rename " << name << suffix << ".\n";
+            remove((dataPath(name) + "." + to_string(generation + 1)).c_str());
+        }
+        remove((dataPath("manifest.txt") + "." + to_string(generation + 1)).c_str());
+    }
+
+    bool isEscaped(const string &name) const
+    {
+        return find(escapedFiles.begin(), escapedFiles.end(), name) != escapedFiles.end();
+    }
+
+    // Report a malformed line in one of the data files
+    static void reportMalformed(const char *file, size_t lineNo, const string &reason)
+    {
+        cout << "Warning: " << file << " line " << lineNo << " skipped: " << reason << "\n";
+    }
+
+    void applyLoan(User *user, const LoanLine &loan)
+    {
+        if (loan.isAccrued)
+            return;
+        if (loan.isFine)
+        {
+            user->getAccount().clearFine();
+            user->getAccount().addFine(loan.fine);
+        }
+        else
+        {
+            user->getAccount().addRecord(loan.rec);
+        }
+    }
+
+    // Build the bitmaps, reservations and indexes for a store filled in bulk.
+    // reserved holds each slot's reservation, which setReservation records.
+    void indexBooks(const int32_t *reserved)
+    {
+        availableBits.resize(books.size());
+        reservedBits.resize(books.size());
+        removedBits.resize(books.size());
+        for (size_t slot = 0; slot < books.size(); ++slot)
+        {
+            setBookStatus(slot, books[slot].getStatus());
+            setReservation(slot, reserved[slot]);
+        }
+        searchIndex.assign(books);
+        catalogIndex.assign(books);
+        booksDirty = true;
+    }
+
+    void loadBooks(string_view text)
+    {
+        unsigned threads = loadThreadCount();
+        bool escaped = isEscaped("books.txt");
+        if (text.size() < PARALLEL_LOAD_MIN_BYTES || threads < 2)
+        {
+            forEachLine(text, 1, [this, escaped](string_view line, size_t lineNo) {
+                Book book;
+                string error;
+                if (!parseBookLine(line, escaped, book, error))
+                    reportMalformed("books.txt", lineNo, error);
+                else if (!addBook(book))
+                    reportMalformed("books.txt", lineNo, "duplicate book ID " + to_string(book.getId()));
+            });
+            return;
+        }
+
+        // Parse newline-aligned chunks on worker threads; line numbers are
+        // chunk-relative until the merge below
+        struct Chunk
+        {
+            vector<pair<size_t, Book>> books;
+            vector<pair<size_t, string>> errors;
+            size_t lines = 0;
+        };
+        vector<string_view> pieces = splitChunks(text, threads);
+        vector<Chunk> chunks(pieces.size());
+        runParallel(pieces.size(), [&](size_t c) {
+            forEachLine(pieces[c], 0, [&](string_view line, size_t lineNo) {
+                Book book;
+                string error;
+                if (parseBookLine(line, escaped, book, error))
+                    chunks[c].books.emplace_back(lineNo, move(book));
+                else
+                    chunks[c].errors.emplace_back(lineNo, error);
+            });
+            chunks[c].lines = count(pieces[c].begin(), pieces[c].end(), '\n');
+        });
+
+        // Merge in file order; the ID index catches duplicates as books are added
+        size_t total = 0;
+        for (auto &chunk : chunks)
+            total += chunk.books.size();
+        books.reserve(books.size() + total);
+        bookIndex.reserve(bookIndex.size() + total);
+        size_t firstLine = 1;
+        for (auto &chunk : chunks)
+        {
+            for (auto &err : chunk.errors)
+                reportMalformed("books.txt", firstLine + err.first, err.second);
+            for (auto &entry : chunk.books)
+            {
+                if (!addBook(entry.second))
+                    reportMalformed("books.txt", firstLine + entry.first, "duplicate book ID " + to_string(entry.second.getId()));
+            }
+            firstLine += chunk.lines;
+        }
+    }
+
+    void loadLoanData()
+    {
+        MappedFile loanFile;
+        if (!loanFile.open(dataPath("fines.txt")))
+        {
+            cout << "fines.txt not found. Starting with empty loan records.\n";
+            return;
+        }
+        string_view text = loanFile.view();
+        unsigned threads = loadThreadCount();
+        if (text.size() < PARALLEL_LOAD_MIN_BYTES || threads < 2)
+        {
+            forEachLine(text, 1, [this](string_view line, size_t lineNo) {
+                LoanLine loan;
+                string error;
+                if (!parseLoanLine(line, loan, error))
+                {
+                    reportMalformed("fines.txt", lineNo, error);
+                    return;
+                }
+                User *user = findUserById(loan.userId);
+                if (user != nullptr)
+                    applyLoan(user, loan);
+            });
+            return;
+        }
+
+        // Phase 1: parse chunks and resolve users against the (read-only) user
+        // index. Each chunk sorts its loans into one bucket per phase 2 worker.
+        struct Chunk
+        {
+            vector<vector<pair<User *, LoanLine>>> loans; // by worker
+            vector<pair<size_t, string>> errors;
+            size_t lines = 0;
+        };
+        vector<string_view> pieces = splitChunks(text, threads);
+        vector<Chunk> chunks(pieces.size());
+        runParallel(pieces.size(), [&](size_t c) {
+            chunks[c].loans.resize(threads);
+            forEachLine(pieces[c], 0, [&](string_view line, size_t lineNo) {
+                LoanLine loan;
+                string error;
+                if (!parseLoanLine(line, loan, error))
+                {
+                    chunks[c].errors.emplace_back(lineNo, error);
+                    return;
+                }
+                User *user = findUserById(loan.userId);
+                if (user != nullptr)
+                    chunks[c].loans[(unsigned)loan.userId % threads].emplace_back(user, loan);
+            });
+            chunks[c].lines = count(pieces[c].begin(), pieces[c].end(), '\n');
+        });
+        size_t firstLine = 1;
+        for (auto &chunk : chunks)
+        {
+            for (auto &err : chunk.errors)
+                reportMalformed("fines.txt", firstLine + err.first, err.second);
+            firstLine += chunk.lines;
+        }
+
+        // Phase 2: attach loans with users partitioned across workers, so each
+        // account is only touched by one thread and sees its lines in file order
+        runParallel(threads, [&](size_t worker) {
+            for (auto &chunk : chunks)
+            {
+                for (auto &entry : chunk.loans[worker])
+                    applyLoan(entry.first, entry.second);
+            }
+        });
+    }
+
+public:
+    Library()
+        : removedCount(0), layoutEpoch(0),
+          journalEnabled(true), journalPaused(false), journalRecords(0), journal(nullptr), clock(&systemClock),
+#ifdef LMS_BINARY_SNAPSHOT
+          binaryFormat(true),
+#else
+          binaryFormat(false),
+#endif
+          generation(0), dataDir("./data"),
+          booksDirty(false), usersDirty(false), loansDirty(false), writerStop(false), flushRequests(0),
+          flushesServed(0), pendingMutations(0) {}
+    ~Library()
+    {
+        stopWriter();
+        if (journal)
+            fclose(journal);
+        for (auto u : users)
+            destroyUser(u);
+    }
+
+    void setJournalEnabled(bool enabled) { journalEnabled = enabled; }
+    // Apply mutations in memory only, e.g. for a simulation that is never saved
+    void setJournalPaused(bool paused) { journalPaused = paused; }
+    void setClock(const Clock *source) { clock = source ? source : &systemClock; }
+    time_t now() const { return clock->now(); }
+    void setBinaryFormat(bool binary) { binaryFormat = binary; }
+    void setDataDir(const string &dir) { dataDir = dir; }
+    const string &getDataDir() const { return dataDir; }
+
+    string dataPath(const char *name) const { return dataDir + "/" + name; }
+
+    const vector<User *> &getUsers() const { return users; }
+
+    // Hash of the whole library state as it would be saved in the text format
+    uint64_t stateChecksum() const
+    {
+        string state = bookFileText() + userFileText() + loanFileText();
+        return fnv1a(state.data(), state.size());
+    }
+
+    BookView bookAt(size_t slot) const { return books[slot]; }
+
+    // Where handles look their book up again after a compaction
+    uint64_t getLayoutEpoch() const { return layoutEpoch; }
+    size_t slotOf(int bid) const
+    {
+        auto it = bookIndex.find(bid);
+        return it == bookIndex.end() ? SIZE_MAX : it->second;
+    }
+    bool isLive(size_t slot) const { return slot < books.size() && !removedBits.test(slot); }
+    size_t bookCount() const { return books.size() - removedCount; }
+
+    size_t availableCount() const { return availableBits.count(); }
+    size_t reservedCount() const { return reservedBits.count(); }
+
+    // Slots of the books held on the shelf for this user, in catalog order
+    vector<size_t> reservedSlotsFor(int userId) const
+    {
+        vector<size_t> slots;
+        auto it = reservationsByUser.find(userId);
+        if (it == reservationsByUser.end())
+            return slots;
+        for (int bid : it->second)
+        {
+            size_t slot = bookIndex.at(bid);
+            if (reservedBits.test(slot))
+                slots.push_back(slot);
+        }
+        sort(slots.begin(), slots.end());
+        return slots;
+    }
+
+    void setReportOptions(const ReportOptions &options) { reportOptions = options; }
+
+    // Show a listing of 'total' rows a page at a time. fill(report) emits the
+    // rows in order and may stop early once report.full().
+    template <typename Fn>
+    void showReport(const string &heading, const char *tsvHeader, size_t total, Fn fill)
+    {
+        size_t pageSize = reportOptions.pageSize == 0 ? SIZE_MAX : reportOptions.pageSize;
+        size_t page = 0;
+        while (true)
+        {
+            size_t first = reportOptions.offset + page * (reportOptions.pageSize == 0 ? 0 : pageSize);
+            Report report(reportOptions.format, first, pageSize);
+            report.text(heading);
+            report.tsvHeader(tsvHeader);
+            fill(report);
+            bool paged = reportOptions.pageSize != 0 && reportOptions.format == ReportFormat::Text;
+            size_t rows = total > reportOptions.offset ? total - reportOptions.offset : 0;
+            size_t pages = paged ? (rows + pageSize - 1) / pageSize : 1;
+            if (paged && pages > 1)
+            {
+                report.text("Showing " + to_string(first + 1) + "-" + to_string(first + report.rowsShown()) + " of " +
+                            to_string(total) + " (page " + to_string(page + 1) + " of " + to_string(pages) + ").\n");
+            }
+            report.flush();
+            if (!paged || pages <= 1)
+                return;
+
+            size_t next;
+            cout << "Enter page number (1-" << pages << "), or 0 to stop: ";
+            if (!(cin >> next))
+            {
+                cin.clear();
+                next = 0;
+            }
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (next == 0 || next > pages)
+                return;
+            page = next - 1;
+        }
+    }
+
+    void displayAvailableBooksForUser(int userId)
+    {
+        vector<size_t> mine = reservedSlotsFor(userId);
+        size_t total = availableCount() + mine.size();
+        showReport("\nAvailable Books (" + to_string(total) + "):\n", BOOK_TSV_HEADER, total, [&](Report &report) {
+            // Merge the user's reserved books into the available ones in catalog order
+            size_t next = 0;
+            availableBits.forEach([&](size_t slot) {
+                while (next < mine.size() && mine[next] < slot)
+                    report.addBook(books[mine[next++]]);
+                report.addBook(books[slot]);
+                return !report.full();
+            });
+            while (next < mine.size() && !report.full())
+                report.addBook(books[mine[next++]]);
+        });
+    }
+
+    void displaySearchResults(const string &query)
+    {
+        vector<int> ids = searchBooks(query);
+        showReport("\nSearch Results (" + to_string(ids.size()) + " found):\n", BOOK_TSV_HEADER, ids.size(), [&](Report &report) {
+            for (size_t i = 0; i < ids.size() && !report.full(); ++i)
+                report.addBook(*findBookById(ids[i]));
+        });
+    }
+
+    void displayQueryResults(const BookQuery &query)
+    {
+        vector<int> ids = queryBooks(query);
+        showReport("\nQuery Results (" + to_string(ids.size()) + " found):\n", BOOK_TSV_HEADER, ids.size(), [&](Report &report) {
+            for (size_t i = 0; i < ids.size() && !report.full(); ++i)
+                report.addBook(*findBookById(ids[i]));
+        });
+    }
+
+    void displayAvailableBooks()
+    {
+        showReport("\nAvailable Books (" + to_string(availableCount()) + "):\n", BOOK_TSV_HEADER, availableCount(), [&](Report &report) {
+            availableBits.forEach([&](size_t slot) {
+                report.addBook(books[slot]);
+                return !report.full();
+            });
+        });
+    }
+
+    void displayAllBooks()
+    {
+        showReport("All Books:\n", BOOK_TSV_HEADER, bookCount(), [&](Report &report) {
+            for (size_t i = 0; i < books.size() && !report.full(); ++i)
+            {
+                if (!removedBits.test(i))
+                    report.addBook(books[i]);
+            }
+        });
+    }
+
+    // Operations that have run at least once, with their latency percentiles
+    void fillStats(Report &report) const
+    {
+        for (size_t i = 0; i < (size_t)Op::Count && !report.full(); ++i)
+        {
+            if (stats.get((Op)i).count() > 0)
+                report.addStat((Op)i, stats.get((Op)i));
+        }
+    }
+
+    size_t statsRows() const
+    {
+        size_t rows = 0;
+        for (size_t i = 0; i < (size_t)Op::Count; ++i)
+            rows += stats.get((Op)i).count() > 0;
+        return rows;
+    }
+
+    void displayStats()
+    {
+        showReport(string("\nOperation Statistics:\n") + STATS_TEXT_HEADER, STATS_TSV_HEADER, statsRows(),
+                   [&](Report &report) { fillStats(report); });
+    }
+
+    // Plain-text statistics table, e.g. on exit
+    void dumpStats(ostream &os) const
+    {
+        Report report(ReportFormat::Text, 0, SIZE_MAX);
+        report.text(string("\nOperation Statistics:\n") + STATS_TEXT_HEADER);
+        fillStats(report);
+        report.flush(os);
+    }
+
+    // Check a user's password; returns the user, or nullptr on a bad ID or password
+    User *login(int uid, const string &password)
+    {
+        ScopedTimer timer(stats, Op::Login);
+        User *user = findUserById(uid);
+        return user != nullptr && user->getPassword() == password ? user : nullptr;
+    }
+
+    // Every loan past its due date, most overdue first
+    void displayOverdueLoans(time_t now)
+    {
+        vector<DueQueue::Entry> overdue;
+        dueDates.forEachDueBefore(now, [&](const DueQueue::Entry &entry) { overdue.push_back(entry); });
+        sort(overdue.begin(), overdue.end(), [](const DueQueue::Entry &a, const DueQueue::Entry &b) {
+            return a.due < b.due || (a.due == b.due && a.bookId < b.bookId);
+        });
+        showReport("\nOverdue Loans (" + to_string(overdue.size()) + "):\n", LOAN_TSV_HEADER, overdue.size(), [&](Report &report) {
+            for (size_t i = 0; i < overdue.size() && !report.full(); ++i)
+            {
+                const DueQueue::Entry &entry = overdue[i];
+                BookHandle book = findBookById(entry.bookId);
+                const User &user = *findUserById(entry.userId);
+                int overdueDays = (int)daysBetween(entry.due, now);
+                if (book)
+                {
+                    BookView view = *book;
+                    report.addLoan(user, &view, entry.bookId, entry.due, overdueDays);
+                }
+                else
+                    report.addLoan(user, nullptr, entry.bookId, entry.due, overdueDays);
+            }
+        });
+    }
+
+    void displayAllUsers()
+    {
+        showReport("All Users:\n", USER_TSV_HEADER, users.size(), [&](Report &report) {
+            for (size_t i = 0; i < users.size() && !report.full(); ++i)
+                report.addUser(*users[i]);
+        });
+    }
+
+    BookHandle findBookById(int id)
+    {
+        auto it = bookIndex.find(id);
+        if (it == bookIndex.end())
+            return BookHandle();
+        return BookHandle(this, id, it->second, layoutEpoch);
+    }
+
+    // IDs of books whose title, author or publisher contain every word of the
+    // query as a word prefix
+    vector<int> searchBooks(const string &query) const
+    {
+        ScopedTimer timer(stats, Op::Search);
+        return searchIndex.search(query);
+    }
+
+    // IDs of books passing every filter of query, in ID order. Circulation may
+    // run alongside, so availability is read under each book's shard lock.
+    vector<int> queryBooks(const BookQuery &query) const
+    {
+        ScopedTimer timer(stats, Op::Query);
+        if (!query.hasIndexedFilter())
+            return vector<int>();
+        shared_lock<shared_mutex> catalog(catalogLock);
+        vector<vector<int>> lists;
+        if (query.byYear)
+            lists.push_back(catalogIndex.years(query.yearFrom, query.yearTo));
+        if (!query.author.empty())
+            lists.push_back(catalogIndex.author(query.author));
+        if (!query.isbn.empty())
+            lists.push_back(catalogIndex.isbn(query.isbn, query.isbnPrefix));
+        vector<int> ids = intersectAll(lists);
+        if (query.availableOnly)
+        {
+            ids.erase(remove_if(ids.begin(), ids.end(),
+                                [&](int id) {
+                                    size_t slot = bookIndex.at(id);
+                                    lock_guard<mutex> lock(bookLock(slot));
+                                    return !availableBits.test(slot);
+                                }),
+                      ids.end());
+        }
+        return ids;
+    }
+
+    bool bookExists(int bid) const { return bookIndex.count(bid) != 0; }
+    bool userExists(int uid) const { return userIndex.count(uid) != 0; }
+    bool usernameExists(const string &uname) const { return usernameIndex.count(uname) != 0; }
+
+    // Who currently holds the book; false if it is not on loan
+    bool findBorrower(int bid, Borrower &borrower) const
+    {
+        shared_lock<shared_mutex> catalog(catalogLock);
+        lock_guard<mutex> lock(loanLock);
+        auto it = loansByBook.find(bid);
+        if (it == loansByBook.end())
+            return false;
+        borrower = it->second;
+        return true;
+    }
+
+    User *findUserById(int uid)
+    {
+        auto it = userIndex.find(uid);
+        return it == userIndex.end() ? nullptr : it->second;
+    }
+
+    // The first user found with this username
+    User *findUserByUsername(const string &uname)
+    {
+        auto it = usernameIndex.find(uname);
+        return it == usernameIndex.end() ? nullptr : it->second;
+    }
+
+    // Add a book; returns false if the ID is already taken
+    bool addBook(const Book &book)
+    {
+        ScopedTimer timer(stats, Op::AddBook, !journalPaused);
+        unique_lock<shared_mutex> catalog(catalogLock);
+        if (bookExists(book.getId()))
+            return false;
+        size_t slot = books.size();
+        bookIndex[book.getId()] = slot;
+        books.push_back(book);
+        books.setReservedBy(slot, -1);
+        setReservation(slot, book.getReservedBy());
+        availableBits.resize(books.size());
+        reservedBits.resize(books.size());
+        removedBits.resize(books.size());
+        setBookStatus(slot, book.getStatus());
+        searchIndex.add(books[slot]);
+        catalogIndex.add(books[slot]);
+        booksDirty = true;
+        // Loaders pause the journal; skip formatting a record it would drop
+        if (!journalPaused)
+            logMutation("ADDBOOK," + to_string(book.getId()) + "," + escapeField(book.getTitle()) + "," +
+                        escapeField(book.getAuthor()) + "," + escapeField(book.getPublisher()) + "," +
+                        to_string(book.getYear()) + "," + escapeField(book.getIsbn()));
+        return true;
+    }
+
+    // Remove a book, closing its loan and dropping its reservation. The slot is
+    // left as a tombstone so other slots and handles stay put.
+    bool removeBook(int bid)
+    {
+        ScopedTimer timer(stats, Op::RemoveBook, !journalPaused);
+        unique_lock<shared_mutex> catalog(catalogLock);
+        auto it = bookIndex.find(bid);
+        if (it == bookIndex.end())
+            return false;
+        size_t slot = it->second;
+        bookIndex.erase(it);
+        if (closeLoanOf(bid))
+            loansDirty = true;
+        setReservation(slot, -1);
+        searchIndex.remove(books[slot]);
+        catalogIndex.remove(books[slot]);
+        availableBits.assign(slot, false);
+        reservedBits.assign(slot, false);
+        removedBits.assign(slot, true);
+        ++removedCount;
+        if (removedCount >= COMPACT_MIN_REMOVED && removedCount * 2 > books.size())
+            compactBooks();
+        booksDirty = true;
+        logMutation("REMOVEBOOK," + to_string(bid));
+        return true;
+    }
+
+    bool updateBookTitle(int bid, const string &title)
+    {
+        ScopedTimer timer(stats, Op::UpdateBook, !journalPaused);
+        unique_lock<shared_mutex> catalog(catalogLock);
+        BookHandle book = findBookById(bid);
+        if (!book)
+            return false;
+        searchIndex.remove(*book);
+        books.setTitle(book.getSlot(), title);
+        searchIndex.add(*book);
+        booksDirty = true;
+        logMutation("TITLE," + to_string(bid) + "," + escapeField(title));
+        return true;
+    }
+
+    // Add a user; returns the new user, or nullptr if the ID is already taken
+    // or, for a new registration, the username is. Users log in by ID, so
+    // loaded data may repeat usernames.
+    User *addUser(UserRole role, int id, const string &username, const string &password, const string &name,
+                  bool registration = false)
+    {
+        ScopedTimer timer(stats, Op::AddUser, !journalPaused);
+        unique_lock<shared_mutex> catalog(catalogLock);
+        if (userExists(id) || (registration && usernameExists(username)))
+            return nullptr;
+        User *user = newUser(role, id, username, password, name);
+        users.push_back(user);
+        userIndex[user->getId()] = user;
+        usernameIndex.emplace(user->getUsername(), user);
+        usersDirty = loansDirty = true;
+        if (!journalPaused)
+            logMutation("ADDUSER," + to_string(user->getId()) + "," + escapeField(user->getUsername()) + "," +
+                        escapeField(user->getPassword()) + "," + toString(user->getRole()) + "," +
+                        escapeField(user->getName()));
+        return user;
+    }
+
+    // Remove a user; all books borrowed by that user are marked as available
+    bool removeUser(int uid)
+    {
+        ScopedTimer timer(stats, Op::RemoveUser, !journalPaused);
+        unique_lock<shared_mutex> catalog(catalogLock);
+        User *user = findUserById(uid);
+        if (user == nullptr)
+            return false;
+        for (auto &rec : user->getAccount().getRecords())
+        {
+            dueDates.remove(uid, rec.bookId);
+            loansByBook.erase(rec.bookId);
+            BookHandle book = findBookById(rec.bookId);
+            if (book)
+            {
+                setBookStatus(book.getSlot(), BookStatus::Available);
+                setReservation(book.getSlot(), -1);
+                booksDirty = true;
+            }
+        }
+        // Release the user's own reservations; books held for them go back on the shelf
+        for (size_t slot : reservedSlotsFor(uid))
+            setBookStatus(slot, BookStatus::Available);
+        auto reserved = reservationsByUser.find(uid);
+        if (reserved != reservationsByUser.end())
+        {
+            vector<int> ids = reserved->second;
+            for (int bid : ids)
+                setReservation(bookIndex.at(bid), -1);
+            booksDirty = true;
+        }
+        userIndex.erase(uid);
+        auto named = usernameIndex.equal_range(user->getUsername());
+        for (auto it = named.first; it != named.second; ++it)
+        {
+            if (it->second == user)
+            {
+                usernameIndex.erase(it);
+                break;
+            }
+        }
+        for (auto it = users.begin(); it != users.end(); ++it)
+        {
+            if (*it == user)
+            {
+                users.erase(it);
+                break;
+            }
+        }
+        destroyUser(user);
+        usersDirty = loansDirty = true;
+        logMutation("REMOVEUSER," + to_string(uid));
+        return true;
+    }
+
+    // Circulation mutations. Callers check the borrowing rules and hold the
+    // locks; these apply the resulting state change and journal it.
+    void borrowBook(User *user, int bid, time_t borrowTime)
+    {
+        BookHandle book = findBookById(bid);
+        if (book)
+        {
+            setBookStatus(book.getSlot(), BookStatus::Borrowed);
+            setReservation(book.getSlot(), -1);
+        }
+        BorrowRecord rec;
+        rec.bookId = bid;
+        rec.borrowTime = borrowTime;
+        user->getAccount().addRecord(rec);
+        {
+            lock_guard<mutex> lock(loanLock);
+            dueDates.push(dueDate(user->getRole(), borrowTime), user->getId(), bid);
+            loansByBook[bid] = Borrower{user->getId(), borrowTime};
+        }
+        booksDirty = loansDirty = true;
+        logMutation("BORROW," + to_string(user->getId()) + "," + to_string(bid) + "," + to_string((long long)borrowTime));
+    }
+
+    void returnBook(User *user, int bid, double fine)
+    {
+        if (user->getAccount().removeRecord(bid))
+        {
+            lock_guard<mutex> lock(loanLock);
+            dueDates.remove(user->getId(), bid);
+            auto it = loansByBook.find(bid);
+            if (it != loansByBook.end() && it->second.userId == user->getId())
+                loansByBook.erase(it);
+        }
+        if (fine > 0)
+            user->getAccount().addFine(fine);
+        BookHandle book = findBookById(bid);
+        if (book)
+        {
+            if (book->getReservedBy() != -1)
+                setBookStatus(book.getSlot(), BookStatus::Reserved);
+            else
+                setBookStatus(book.getSlot(), BookStatus::Available);
+        }
+        booksDirty = loansDirty = true;
+        ostringstream rec;
+        rec << "RETURN," << user->getId() << "," << bid << "," << fine;
+        logMutation(rec.str());
+    }
+
+    void reserveBook(User *user, int bid)
+    {
+        BookHandle book = findBookById(bid);
+        if (book)
+            setReservation(book.getSlot(), user->getId());
+        booksDirty = true;
+        logMutation("RESERVE," + to_string(user->getId()) + "," + to_string(bid));
+    }
+
+    void payFine(User *user)
+    {
+        user->getAccount().clearFine();
+        loansDirty = true;
+        logMutation("PAYFINE," + to_string(user->getId()));
+    }
+
+    // Circulation rules. These check a request the way the dashboards always
+    // have and apply it through the mutations above when it is allowed. Each
+    // holds its user's and book's locks across the check and the change, so
+    // two sessions racing for the same book cannot both get it.
+
+    // Whether the user may borrow anything right now, before a book is chosen
+    CircResult checkBorrow(int uid, time_t now) const
+    {
+        shared_lock<shared_mutex> catalog(catalogLock);
+        auto it = userIndex.find(uid);
+        if (it == userIndex.end())
+            return CircResult::UserNotFound;
+        lock_guard<mutex> userGuard(userLock(uid));
+        return borrowRule(it->second, now);
+    }
+
+    CircResult tryBorrow(int uid, int bid, time_t now)
+    {
+        ScopedTimer timer(stats, Op::Borrow);
+        shared_lock<shared_mutex> catalog(catalogLock);
+        User *user = findUserById(uid);
+        if (user == nullptr)
+            return CircResult::UserNotFound;
+        lock_guard<mutex> userGuard(userLock(uid));
+        CircResult result = borrowRule(user, now);
+        if (result != CircResult::Ok)
+            return result;
+        BookHandle book = findBookById(bid);
+        if (!book)
+            return CircResult::BookNotFound;
+        lock_guard<mutex> bookGuard(bookLock(book.getSlot()));
+        if (!(book->getStatus() == BookStatus::Available ||
+              (book->getStatus() == BookStatus::Reserved && book->getReservedBy() == uid)))
+            return CircResult::NotAvailable;
+        borrowBook(user, bid, now);
+        return CircResult::Ok;
+    }
+
+    CircResult tryReturn(int uid, int bid, time_t now, ReturnInfo &info)
+    {
+        ScopedTimer timer(stats, Op::Return);
+        shared_lock<shared_mutex> catalog(catalogLock);
+        User *user = findUserById(uid);
+        if (user == nullptr)
+            return CircResult::UserNotFound;
+        if (user->getRole() == UserRole::Librarian)
+            return CircResult::NotAllowed;
+        lock_guard<mutex> userGuard(userLock(uid));
+        const BorrowRecord *loan = nullptr;
+        for (auto &rec : user->getAccount().getRecords())
+        {
+            if (rec.bookId == bid)
+            {
+                loan = &rec;
+                break;
+            }
+        }
+        if (loan == nullptr)
+            return CircResult::NotBorrowed;
+        bool student = user->getRole() == UserRole::Student;
+        double days = daysBetween(loan->borrowTime, now);
+        int period = student ? STUDENT_BORROW_PERIOD : FACULTY_BORROW_PERIOD;
+        info.late = days > period;
+        info.overdueDays = info.late ? (int)(days - period) : 0;
+        info.fine = student ? info.overdueDays * STUDENT_FINE_PER_DAY : 0;
+        BookHandle book = findBookById(bid);
+        unique_lock<mutex> bookGuard;
+        if (book)
+            bookGuard = unique_lock<mutex>(bookLock(book.getSlot()));
+        returnBook(user, bid, info.fine);
+        return CircResult::Ok;
+    }
+
+    CircResult tryReserve(int uid, int bid)
+    {
+        ScopedTimer timer(stats, Op::Reserve);
+        shared_lock<shared_mutex> catalog(catalogLock);
+        User *user = findUserById(uid);
+        if (user == nullptr)
+            return CircResult::UserNotFound;
+        if (user->getRole() == UserRole::Librarian)
+            return CircResult::NotAllowed;
+        lock_guard<mutex> userGuard(userLock(uid));
+        BookHandle book = findBookById(bid);
+        if (!book)
+            return CircResult::BookNotFound;
+        lock_guard<mutex> bookGuard(bookLock(book.getSlot()));
+        if (book->getStatus() == BookStatus::Borrowed && book->getReservedBy() == -1)
+        {
+            reserveBook(user, bid);
+            return CircResult::Ok;
+        }
+        if (book->getReservedBy() != -1)
+            return CircResult::AlreadyReserved;
+        return CircResult::NoNeedToReserve;
+    }
+
+    CircResult tryPayFine(int uid, double &paid)
+    {
+        ScopedTimer timer(stats, Op::PayFine);
+        shared_lock<shared_mutex> catalog(catalogLock);
+        paid = 0;
+        User *user = findUserById(uid);
+        if (user == nullptr)
+            return CircResult::UserNotFound;
+        lock_guard<mutex> userGuard(userLock(uid));
+        paid = user->getAccount().getFine();
+        if (paid <= 0)
+            return CircResult::NoFine;
+        payFine(user);
+        return CircResult::Ok;
+    }
+
+    // Check a user's password; on success return the user's role
+    bool authenticate(int uid, const string &password, UserRole &role) const
+    {
+        ScopedTimer timer(stats, Op::Login);
+        shared_lock<shared_mutex> catalog(catalogLock);
+        auto it = userIndex.find(uid);
+        if (it == userIndex.end() || it->second->getPassword() != password)
+            return false;
+        role = it->second->getRole();
+        return true;
+    }
+
+    // Fine Sweep
+    // Fines accrued but not yet billed on every student's open loans, and the
+    // borrow block of every faculty member, as of 'now'. The user list is
+    // split into slices that are swept on worker threads and merged in order.
+    SweepResult sweep(time_t now) const
+    {
+        unique_lock<shared_mutex> catalog(catalogLock);
+        size_t parts = max<size_t>(1, min<size_t>(loadThreadCount(), users.size() / 4096));
+        vector<SweepResult> slices(parts);
+        runParallel(parts, [&](size_t part) {
+            SweepResult &slice = slices[part];
+            size_t begin = users.size() * part / parts;
+            size_t end = users.size() * (part + 1) / parts;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const User *user = users[i];
+                const Account &account = user->getAccount();
+                UserRole role = user->getRole();
+                if (role == UserRole::Librarian)
+                    continue;
+                SweepRow row = {user, 0, 0, false};
+                int period = loanPeriod(role);
+                for (auto &rec : account.getRecords())
+                {
+                    double days = daysBetween(rec.borrowTime, now);
+                    if (days <= period)
+                        continue;
+                    ++row.overdueLoans;
+                    if (role == UserRole::Student)
+                        row.accrued += (int)(days - period) * STUDENT_FINE_PER_DAY;
+                }
+                slice.openLoans += account.getRecords().size();
+                slice.overdueLoans += row.overdueLoans;
+                if (role == UserRole::Student)
+                {
+                    slice.billed += account.getFine();
+                    if (row.accrued > 0)
+                    {
+                        ++slice.studentsAccruing;
+                        slice.accrued += row.accrued;
+                        slice.rows.push_back(row);
+                    }
+                }
+                else if (!account.getRecords().empty() &&
+                         daysBetween(account.getOldestBorrowTime(), now) > FACULTY_OVERDUE_LIMIT)
+                {
+                    row.blocked = true;
+                    ++slice.facultyBlocked;
+                    slice.rows.push_back(row);
+                }
+            }
+        });
+
+        SweepResult result;
+        result.users = users.size();
+        for (auto &slice : slices)
+        {
+            result.rows.insert(result.rows.end(), slice.rows.begin(), slice.rows.end());
+            result.openLoans += slice.openLoans;
+            result.overdueLoans += slice.overdueLoans;
+            result.studentsAccruing += slice.studentsAccruing;
+            result.facultyBlocked += slice.facultyBlocked;
+            result.accrued += slice.accrued;
+            result.billed += slice.billed;
+        }
+        return result;
+    }
+
+    void displaySweep(const SweepResult &result)
+    {
+        ostringstream heading;
+        heading << fixed << setprecision(0);
+        heading << "\nFine Sweep: " << result.users << " users, " << result.openLoans << " open loans, "
+                << result.overdueLoans << " overdue.\n"
+                << "Students with accrued fines: " << result.studentsAccruing << " (" << result.accrued
+                << " rupees accrued, " << result.billed << " rupees already billed).\n"
+                << "Faculty blocked from borrowing: " << result.facultyBlocked << ".\n";
+        showReport(heading.str(), SWEEP_TSV_HEADER, result.rows.size(), [&](Report &report) {
+            for (size_t i = 0; i < result.rows.size() && !report.full(); ++i)
+                report.addSweepRow(result.rows[i]);
+        });
+    }
+
+    // Checkpoint with the accrued fines of a sweep added to fines.txt. The
+    // ACCRUED lines are informational: loading ignores them, and fines are
+    // still billed on return.
+    void saveSweep(const SweepResult &result)
+    {
+        if (binaryFormat)
+        {
+            cout << "Accrued fines can only be saved to fines.txt in the text format.\n";
+            return;
+        }
+        for (auto &row : result.rows)
+        {
+            if (row.accrued > 0)
+                accrualSnapshot[row.user->getId()] = row.accrued;
+        }
+        size_t saved = accrualSnapshot.size();
+        loansDirty = true;
+        checkpoint();
+        cout << "Saved " << saved << " accrued fines to fines.txt.\n";
+    }
+
+    void loadData()
+    {
+        ScopedTimer timer(stats, Op::Load);
+        // Loading and replay rebuild existing state, so nothing is journaled
+        journalPaused = true;
+        catalogIndex.setDeferSort(true);
+        recoverSnapshot();
+        // The files of the other format may be stale, so load the snapshot the
+        // manifest committed whichever format this run saves in
+        bool loadBinary = committedFormat.empty() ? binaryFormat : committedFormat == "binary";
+        bool loadedBinary = loadBinary && loadBinarySnapshot();
+        if (!loadedBinary)
+            loadTextSnapshot();
+
+        // The snapshot files match memory until the journal is replayed over
+        // them, unless they are in the other format and must all be written
+        booksDirty = usersDirty = loansDirty = loadedBinary != binaryFormat;
+        rebuildLoanIndexes();
+        replayJournal();
+        catalogIndex.setDeferSort(false);
+        checkConsistency();
+        journalPaused = false;
+    }
+
+    void loadTextSnapshot()
+    {
+        // Load books
+        MappedFile bookFile;
+        if (bookFile.open(dataPath("books.txt")))
+        {
+            loadBooks(bookFile.view());
+        }
+        else
+        {
+            cout << "books.txt not found. Starting with empty book list.\n";
+        }
+
+        // Load users
+        MappedFile userFile;
+        if (userFile.open(dataPath("users.txt")))
+        {
+            bool escaped = isEscaped("users.txt");
+            forEachLine(userFile.view(), 1, [this, escaped](string_view line, size_t lineNo) {
+                string_view f[5];
+                if (splitFields(line, f, 5, escaped) != 5)
+                {
+                    reportMalformed("users.txt", lineNo, "expected 5 fields");
+                    return;
+                }
+                int id;
+                if (!parseNumber(f[0], id))
+                {
+                    reportMalformed("users.txt", lineNo, "invalid user ID");
+                    return;
+                }
+                UserRole role;
+                if (!parseUserRole(f[3], role))
+                {
+                    reportMalformed("users.txt", lineNo, "unknown role");
+                    return;
+                }
+                if (!addUser(role, id, fileField(f[1], escaped), fileField(f[2], escaped), fileField(f[4], escaped)))
+                    reportMalformed("users.txt", lineNo, "duplicate user ID");
+            });
+        }
+        else
+        {
+            cout << "users.txt not found. Starting with empty user list.\n";
+        }
+
+        loadLoanData();
+    }
+
+    // Load data/library.bin. Returns false, leaving the library empty, if the
+    // file is missing or fails validation.
+    bool loadBinarySnapshot()
+    {
+        MappedFile file;
+        if (!file.open(dataPath("library.bin")))
+        {
+            cout << "library.bin not found. Loading text files instead.\n";
+            return false;
+        }
+        string_view raw = file.view();
+        SnapshotHeader header;
+        if (raw.size() < sizeof(header))
+        {
+            cout << "Error: library.bin is truncated. Loading text files instead.\n";
+            return false;
+        }
+        memcpy(&header, raw.data(), sizeof(header));
+        string_view payload = raw.substr(sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION)
+        {
+            cout << "Error: library.bin has an unsupported format or version. Loading text files instead.\n";
+            return false;
+        }
+        if (header.payloadBytes != payload.size() || header.checksum != fnv1a(payload.data(), payload.size()))
+        {
+            cout << "Error: library.bin failed its checksum. Loading text files instead.\n";
+            return false;
+        }
+
+        BinaryReader in(payload);
+        bool ok = true;
+
+        uint64_t bookCount = 0;
+        vector<int32_t> ids, years, reserved;
+        vector<uint8_t> statuses;
+        ok = ok && in.get(bookCount) && in.getColumn(ids, bookCount) && in.getColumn(years, bookCount) &&
+             in.getColumn(reserved, bookCount) && in.getColumn(statuses, bookCount);
+        // Fill the store straight from the columns; the bitmaps, reservations
+        // and indexes are built once every row is in
+        if (ok)
+        {
+            books.reserve(bookCount);
+            bookIndex.reserve(bookCount);
+        }
+        for (uint64_t i = 0; ok && i < bookCount; ++i)
+        {
+            string_view title, author, publisher, isbn;
+            ok = in.getString(title) && in.getString(author) && in.getString(publisher) && in.getString(isbn) &&
+                 statuses[i] <= (uint8_t)BookStatus::Reserved && bookIndex.emplace(ids[i], books.size()).second;
+            if (ok)
+                books.append(BookState{ids[i], -1, (BookStatus)statuses[i]}, title, author, publisher, isbn, years[i]);
+        }
+        if (ok)
+            indexBooks(reserved.data());
+
+        uint64_t userCount = 0;
+        vector<uint8_t> roles;
+        vector<double> fines;
+        ok = ok && in.get(userCount) && in.getColumn(ids, userCount) && in.getColumn(roles, userCount) &&
+             in.getColumn(fines, userCount);
+        for (uint64_t i = 0; ok && i < userCount; ++i)
+        {
+            string uname, pwd, fname;
+            ok = in.getString(uname) && in.getString(pwd) && in.getString(fname) && roles[i] <= (uint8_t)UserRole::Librarian;
+            if (!ok)
+                break;
+            User *user = addUser((UserRole)roles[i], ids[i], uname, pwd, fname);
+            if (user != nullptr)
+                user->getAccount().addFine(fines[i]);
+        }
+
+        uint64_t loanCount = 0;
+        vector<int32_t> loanUsers, loanBooks;
+        vector<int64_t> loanTimes;
+        ok = ok && in.get(loanCount) && in.getColumn(loanUsers, loanCount) && in.getColumn(loanBooks, loanCount) &&
+             in.getColumn(loanTimes, loanCount) && in.atEnd();
+        for (uint64_t i = 0; ok && i < loanCount; ++i)
+        {
+            User *user = findUserById(loanUsers[i]);
+            if (user != nullptr)
+                user->getAccount().addRecord(BorrowRecord{loanBooks[i], (time_t)loanTimes[i]});
+        }
+
+        if (!ok)
+        {
+            cout << "Error: library.bin is malformed. Loading text files instead.\n";
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    string binarySnapshot() const
+    {
+        BinaryWriter out;
+
+        vector<int32_t> ids, years, reserved;
+        vector<uint8_t> statuses;
+        vector<BookView> live;
+        for (size_t i = 0; i < books.size(); ++i)
+        {
+            if (!removedBits.test(i))
+                live.push_back(books[i]);
+        }
+        for (auto &book : live)
+        {
+            ids.push_back(book.getId());
+            years.push_back(book.getYear());
+            reserved.push_back(book.getReservedBy());
+            statuses.push_back((uint8_t)book.getStatus());
+        }
+        out.put((uint64_t)live.size());
+        out.putColumn(ids);
+        out.putColumn(years);
+        out.putColumn(reserved);
+        out.putColumn(statuses);
+        for (auto &book : live)
+        {
+            out.putString(book.getTitle());
+            out.putString(book.getAuthor());
+            out.putString(book.getPublisher());
+            out.putString(book.getIsbn());
+        }
+
+        ids.clear();
+        vector<uint8_t> roles;
+        vector<double> fines;
+        vector<int32_t> loanUsers, loanBooks;
+        vector<int64_t> loanTimes;
+        for (auto user : users)
+        {
+            ids.push_back(user->getId());
+            roles.push_back((uint8_t)user->getRole());
+            fines.push_back(user->getAccount().getFine());
+            for (auto &rec : user->getAccount().getRecords())
+            {
+                loanUsers.push_back(user->getId());
+                loanBooks.push_back(rec.bookId);
+                loanTimes.push_back((int64_t)rec.borrowTime);
+            }
+        }
+        out.put((uint64_t)users.size());
+        out.putColumn(ids);
+        out.putColumn(roles);
+        out.putColumn(fines);
+        for (auto user : users)
+        {
+            out.putString(user->getUsername());
+            out.putString(user->getPassword());
+            out.putString(user->getName());
+        }
+
+        out.put((uint64_t)loanUsers.size());
+        out.putColumn(loanUsers);
+        out.putColumn(loanBooks);
+        out.putColumn(loanTimes);
+
+        const string &payload = out.data();
+        SnapshotHeader header;
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.payloadBytes = payload.size();
+        header.checksum = fnv1a(payload.data(), payload.size());
+
+        string file;
+        file.reserve(sizeof(header) + payload.size());
+        file.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        file += payload;
+        return file;
+    }
+
+private:
+    // Format the snapshot files whose contents changed since they were last
+    // written, and count them as clean from here on
+    vector<pair<const char *, string>> changedFiles()
+    {
+        vector<pair<const char *, string>> files;
+        if (binaryFormat)
+        {
+            if (booksDirty || usersDirty || loansDirty)
+                files.emplace_back("library.bin", binarySnapshot());
+        }
+        else
+        {
+            if (booksDirty)
+                files.emplace_back("books.txt", bookFileText());
+            if (usersDirty)
+                files.emplace_back("users.txt", userFileText());
+            if (loansDirty)
+                files.emplace_back("fines.txt", loanFileText());
+        }
+        booksDirty = usersDirty = loansDirty = false;
+        // Accrued fines are written by one save only
+        accrualSnapshot.clear();
+        return files;
+    }
+
+    // Write the pending journal records, then checkpoint if one is due. An
+    // idle pass neither touches the disk nor counts as a commit.
+    void writePending(bool compact = true)
+    {
+        if (unwrittenMutations() == 0)
+            return;
+        bool due;
+        {
+            ScopedTimer timer(stats, Op::Commit);
+            lock_guard<mutex> serial(commitLock);
+            due = flushPending();
+        }
+        if (due)
+            checkpoint(compact);
+    }
+
+    size_t unwrittenMutations()
+    {
+        lock_guard<mutex> lock(journalLock);
+        return pendingMutations;
+    }
+
+    // Writer thread: a pass every GROUP_COMMIT_MAX_DELAY_MS, or sooner when a
+    // flush is requested. Each pass writes everything handed off so far.
+    void writerLoop()
+    {
+        unique_lock<mutex> lock(writerLock);
+        while (true)
+        {
+            writerWake.wait_for(lock, chrono::milliseconds(GROUP_COMMIT_MAX_DELAY_MS),
+                                [this]() { return writerStop || flushesServed < flushRequests; });
+            uint64_t serving = flushRequests;
+            bool stopping = writerStop;
+            lock.unlock();
+            // The dashboards read the catalog without its lock, so slots are
+            // only ever moved on the thread that mutates it
+            writePending(false);
+            lock.lock();
+            flushesServed = serving;
+            writerPassDone.notify_all();
+            if (stopping)
+                return;
+        }
+    }
+
+public:
+    // Run group commits and checkpoints on a writer thread of their own, so
+    // that patrons never wait for the disk
+    void startWriter()
+    {
+        if (writer.joinable())
+            return;
+        writerStop = false;
+        writer = thread(&Library::writerLoop, this);
+    }
+
+    // Make everything handed off so far durable and stop the writer
+    void stopWriter()
+    {
+        if (!writer.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(writerLock);
+            writerStop = true;
+        }
+        writerWake.notify_one();
+        writer.join();
+    }
+
+    // Make every pending mutation durable in a single flush. With the writer
+    // running, the flush is done there and this waits for it.
+    void commit()
+    {
+        if (!writer.joinable())
+        {
+            writePending();
+            return;
+        }
+        unique_lock<mutex> lock(writerLock);
+        uint64_t ticket = ++flushRequests;
+        writerWake.notify_one();
+        writerPassDone.wait(lock, [&]() { return flushesServed >= ticket; });
+    }
+
+    // Ask for a flush without waiting for it, e.g. on logout
+    void commitSoon()
+    {
+        if (!writer.joinable())
+        {
+            writePending();
+            return;
+        }
+        lock_guard<mutex> lock(writerLock);
+        ++flushRequests;
+        writerWake.notify_one();
+    }
+
+    // Called after each command. With the writer running this returns at once
+    // unless WRITER_MAX_UNWRITTEN mutations are still waiting for it. Without
+    // it, this commits if enough mutations are pending or the oldest has
+    // waited long enough.
+    void maybeCommit()
+    {
+        if (writer.joinable())
+        {
+            if (unwrittenMutations() < GROUP_COMMIT_MAX_MUTATIONS)
+                return;
+            unique_lock<mutex> lock(writerLock);
+            ++flushRequests;
+            writerWake.notify_one();
+            writerPassDone.wait(lock, [this]() { return writerStop || unwrittenMutations() < WRITER_MAX_UNWRITTEN; });
+            return;
+        }
+        {
+            lock_guard<mutex> lock(journalLock);
+            if (pendingMutations == 0)
+                return;
+            auto waited = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - firstPending);
+            if (pendingMutations < GROUP_COMMIT_MAX_MUTATIONS && waited.count() < GROUP_COMMIT_MAX_DELAY_MS)
+                return;
+        }
+        writePending();
+    }
+
+    // Write a complete snapshot in the current format, e.g. after converting formats
+    void saveAll()
+    {
+        booksDirty = usersDirty = loansDirty = true;
+        checkpoint();
+    }
+
+    // Fold the journal into the snapshot files and start a fresh journal. The
+    // files are formatted under the catalog lock and written after releasing
+    // it, so circulation only waits for the formatting. Mutations made while
+    // the files are written stay queued (commitLock is held) and go to the
+    // new journal. With compact set, the tombstones of removed books are
+    // dropped first.
+    void checkpoint(bool compact = true)
+    {
+        unique_lock<shared_mutex> catalog(catalogLock);
+        lock_guard<mutex> serial(commitLock);
+        flushPending();
+        // Nothing changed since the snapshot, e.g. a read-only session
+        if (!booksDirty && !usersDirty && !loansDirty && journalRecords == 0)
+            return;
+        ScopedTimer timer(stats, Op::Checkpoint);
+        if (compact)
+            compactBooks();
+        vector<pair<const char *, string>> files = changedFiles();
+        catalog.unlock();
+        if (!files.empty())
+        {
+            ScopedTimer save(stats, Op::Save);
+            // Until the snapshot is committed the journal is still needed
+            if (!commitSnapshot(files))
+            {
+                booksDirty = usersDirty = loansDirty = true;
+                return;
+            }
+        }
+        if (journal)
+            fclose(journal);
+        journal = fopen(dataPath("journal.txt").c_str(), "w");
+        if (journal)
+            startJournal();
+        journalRecords = 0;
+    }
+};
+
+size_t BookHandle::resolve() const
+{
+    if (epoch != lib->getLayoutEpoch())
+    {
+        slot = lib->slotOf(id);
+        epoch = lib->getLayoutEpoch();
+    }
+    return slot;
+}
+
+BookHandle::operator bool() const
+{
+    if (lib == nullptr)
+        return false;
+    size_t at = resolve();
+    return at != SIZE_MAX && lib->isLive(at);
+}
+
+BookView BookHandle::operator->() const { return lib->bookAt(resolve()); }
+BookView BookHandle::operator*() const { return lib->bookAt(resolve()); }
+
+// Ask for the filters of a catalog query and show the matching books
+static void runBookQuery(Library &lib)
+{
+    BookQuery query;
+    string line;
+    cout << "Publication years, e.g. 1900-1950 or 1958 (blank for any): ";
+    getline(cin, line);
+    if (!line.empty())
+    {
+        if (!parseYearRange(line, query.yearFrom, query.yearTo))
+        {
+            cout << "Invalid year range.\n";
+            return;
+        }
+        query.byYear = true;
+    }
+    cout << "Author (blank for any): ";
+    getline(cin, query.author);
+    cout << "ISBN, or a prefix ending in * (blank for any): ";
+    getline(cin, line);
+    if (!line.empty() && !parseIsbnFilter(line, query))
+    {
+        cout << "Invalid ISBN.\n";
+        return;
+    }
+    cout << "Only available books? (y/n): ";
+    getline(cin, line);
+    query.availableOnly = line == "y" || line == "Y";
+    if (!query.hasIndexedFilter())
+    {
+        cout << "Enter a year range, an author or an ISBN.\n";
+        return;
+    }
+    lib.displayQueryResults(query);
+}
+
+// Student Dashboard
+void Student::dashboard(Library &lib)
+{
+    int choice;
+    do
+    {
+        cout << "\n--- STUDENT DASHBOARD (" << getName() << ") ---\n";
+        cout << "1. View Available Books\n";
+        cout << "2. Borrow a Book\n";
+        cout << "3. Return a Book\n";
+        cout << "4. View Borrowed Books\n";
+        cout << "5. Check Fine Amount\n";
         cout << "6. Pay Fine\n";
         cout << "7. Reserve a Book\n";
-        cout << "8. Logout\n";
+        cout << "8. Search Books\n";
+        cout << "9. Query Books by Year, Author or ISBN\n";
+        cout << "10. Logout\n";
+        cout << "Enter your choice: ";
+        cin >> choice;
+        if (!cin)
+            break;
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+        if (choice == 1)
+        {
+            lib.displayAvailableBooksForUser(getId());
+        }
+        else if (choice == 2)
+        {
+            CircResult status = lib.checkBorrow(getId(), lib.now());
+            if (status != CircResult::Ok)
+            {
+                cout << describe(status) << "\n";
+            }
+            else
+            {
+                int bid;
+                cout << "Enter Book ID to borrow: ";
+                cin >> bid;
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                status = lib.tryBorrow(getId(), bid, lib.now());
+                if (status == CircResult::Ok)
+                    cout << "Book borrowed successfully.\n";
+                else
+                    cout << describe(status) << "\n";
+            }
+        }
+        else if (choice == 3)
+        {
+            int bid;
+            cout << "Enter Book ID to return: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            ReturnInfo info;
+            CircResult status = lib.tryReturn(getId(), bid, lib.now(), info);
+            if (status != CircResult::Ok)
+                cout << describe(status) << "\n";
+            else if (info.late)
+                cout << "Book returned overdue by " << info.overdueDays
+                     << " days. Fine incurred: " << info.fine << " rupees.\n";
+            else
+                cout << "Book returned on time.\n";
+        }
+        else if (choice == 4)
+        {
+            cout << "Your Borrowed Books:\n";
+            for (auto &rec : getAccount().getRecords())
+            {
+                cout << "Book ID: " << rec.bookId << " Borrowed on: " << ctime(&rec.borrowTime);
+            }
+        }
+        else if (choice == 5)
+        {
+            cout << "Total fine: " << getAccount().getFine() << " rupees.\n";
+        }
+        else if (choice == 6)
+        {
+            double paid;
+            CircResult status = lib.tryPayFine(getId(), paid);
+            if (status == CircResult::Ok)
+                cout << "Paying fine of " << paid << " rupees. Fine cleared.\n";
+            else
+                cout << describe(status) << "\n";
+        }
+        else if (choice == 7)
+        {
+            int bid;
+            cout << "Enter Book ID to reserve: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            CircResult status = lib.tryReserve(getId(), bid);
+            if (status == CircResult::Ok)
+                cout << "Book reserved successfully. Upon return, it will be available only for you.\n";
+            else
+                cout << describe(status) << "\n";
+        }
+        else if (choice == 8)
+        {
+            string query;
+            cout << "Enter search words (title, author or publisher): ";
+            getline(cin, query);
+            lib.displaySearchResults(query);
+        }
+        else if (choice == 9)
+        {
+            runBookQuery(lib);
+        }
+        lib.maybeCommit();
+    } while (choice != 10);
+    lib.commitSoon();
+}
+
+// Faculty Dashboard
+void Faculty::dashboard(Library &lib)
+{
+    int choice;
+    do
+    {
+        cout << "\n--- FACULTY DASHBOARD (" << getName() << ") ---\n";
+        cout << "1. View Available Books\n";
+        cout << "2. Borrow a Book\n";
+        cout << "3. Return a Book\n";
+        cout << "4. View Borrowed Books\n";
+        cout << "5. Check Borrowing Status\n";
+        cout << "6. Reserve a Book\n";
+        cout << "7. Search Books\n";
+        cout << "8. Query Books by Year, Author or ISBN\n";
+        cout << "9. Logout\n";
+        cout << "Enter your choice: ";
+        cin >> choice;
+        if (!cin)
+            break;
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+        if (choice == 1)
+        {
+            lib.displayAvailableBooksForUser(getId());
+        }
+        else if (choice == 2)
+        {
+            CircResult status = lib.checkBorrow(getId(), lib.now());
+            if (status != CircResult::Ok)
+            {
+                cout << describe(status) << "\n";
+            }
+            else
+            {
+                int bid;
+                cout << "Enter Book ID to borrow: ";
+                cin >> bid;
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                status = lib.tryBorrow(getId(), bid, lib.now());
+                if (status == CircResult::Ok)
+                    cout << "Book borrowed successfully.\n";
+                else
+                    cout << describe(status) << "\n";
+            }
+        }
+        else if (choice == 3)
+        {
+            int bid;
+            cout << "Enter Book ID to return: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            ReturnInfo info;
+            CircResult status = lib.tryReturn(getId(), bid, lib.now(), info);
+            if (status != CircResult::Ok)
+                cout << describe(status) << "\n";
+            else if (info.late)
+                cout << "Book returned late. Overdue by " << info.overdueDays << " days.\n";
+            else
+                cout << "Book returned on time.\n";
+        }
+        else if (choice == 4)
+        {
+            cout << "Your Borrowed Books:\n";
+            for (auto &rec : getAccount().getRecords())
+            {
+                cout << "Book ID: " << rec.bookId << " Borrowed on: " << ctime(&rec.borrowTime);
+            }
+        }
+        else if (choice == 5)
+        {
+            cout << "Currently borrowed: " << getAccount().getRecords().size() << " books.\n";
+        }
+        else if (choice == 6)
+        {
+            int bid;
+            cout << "Enter Book ID to reserve: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            CircResult status = lib.tryReserve(getId(), bid);
+            if (status == CircResult::Ok)
+                cout << "Book reserved successfully. Upon return, it will be available only for you.\n";
+            else
+                cout << describe(status) << "\n";
+        }
+        else if (choice == 7)
+        {
+            string query;
+            cout << "Enter search words (title, author or publisher): ";
+            getline(cin, query);
+            lib.displaySearchResults(query);
+        }
+        else if (choice == 8)
+        {
+            runBookQuery(lib);
+        }
+        lib.maybeCommit();
+    } while (choice != 9);
+    lib.commitSoon();
+}
+
+// Librarian Dashboard
+void Librarian::dashboard(Library &lib)
+{
+    int choice;
+    do
+    {
+        cout << "\n--- LIBRARIAN DASHBOARD (" << getName() << ") ---\n";
+        cout << "1. Add a New Book\n";
+        cout << "2. Remove a Book\n";
+        cout << "3. Update Book Information\n";
+        cout << "4. Add a New User\n";
+        cout << "5. Remove a User\n";
+        cout << "6. View All Books\n";
+        cout << "7. View All Users\n";
+        cout << "8. View Overdue Loans\n";
+        cout << "9. Show Statistics\n";
+        cout << "10. Query Books by Year, Author or ISBN\n";
+        cout << "11. Logout\n";
         cout << "Enter your choice: ";
         cin >> choice;
+        if (!cin)
+            break;
         cin.ignore(numeric_limits<streamsize>::max(), '\n');
-
-        if (choice == 1)
+        switch (choice)
         {
-            lib.displayAvailableBooksForUser(getId());
+        case 1:
+        {
+            cout << "Enter new book details:\n";
+            int bid, pubYear;
+            string title, author, publisher, isbn;
+            cout << "ID: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (lib.bookExists(bid))
+            {
+                cout << "Book with ID " << bid << " already exists. Cannot add duplicate book.\n";
+                break;
+            }
+            cout << "Title: ";
+            getline(cin, title);
+            cout << "Author: ";
+            getline(cin, author);
+            cout << "Publisher: ";
+            getline(cin, publisher);
+            cout << "Year: ";
+            cin >> pubYear;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "ISBN: ";
+            getline(cin, isbn);
+            lib.addBook(Book(bid, title, author, publisher, pubYear, isbn, BookStatus::Available, -1));
+            cout << "New book added: " << title << "\n";
+            break;
         }
-        else if (choice == 2)
+        case 2:
+        {
+            int bid;
+            cout << "Enter Book ID to remove: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (lib.removeBook(bid))
+                cout << "Book " << bid << " removed.\n";
+            else
+                cout << "Book not found.\n";
+            break;
+        }
+        case 3:
+        {
+            int bid;
+            cout << "Enter Book ID to update: ";
+            cin >> bid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            string newTitle;
+            cout << "Enter new title: ";
+            getline(cin, newTitle);
+            if (lib.updateBookTitle(bid, newTitle))
+                cout << "Book " << bid << " updated to: " << newTitle << "\n";
+            else
+                cout << "Book not found.\n";
+            break;
+        }
+        case 4:
         {
-            if (getAccount().getRecords().size() >= STUDENT_MAX_BORROW)
+            cout << "Enter new user details:\n";
+            int uid;
+            string uname, pwd, urole, fname;
+            cout << "ID: ";
+            cin >> uid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (lib.userExists(uid))
             {
-                cout << "Borrowing limit reached.\n";
+                cout << "User with ID " << uid << " already exists. Cannot add duplicate user.\n";
+                break;
             }
-            else if (getAccount().getFine() > 0)
+            cout << "Username: ";
+            getline(cin, uname);
+            if (lib.usernameExists(uname))
             {
-                cout << "Outstanding fine. Please clear your fine before borrowing.\n";
+                cout << "Username " << uname << " is already taken. Cannot add duplicate user.\n";
+                break;
             }
+            cout << "Password: ";
+            getline(cin, pwd);
+            cout << "Role (Student/Faculty): ";
+            getline(cin, urole);
+            cout << "Name: ";
+            getline(cin, fname);
+            bool added = false;
+            if (urole == "Student")
+                added = lib.addUser(UserRole::Student, uid, uname, pwd, fname, true) != nullptr;
+            else if (urole == "Faculty")
+                added = lib.addUser(UserRole::Faculty, uid, uname, pwd, fname, true) != nullptr;
             else
             {
-                int bid;
-                cout << "Enter Book ID to borrow: ";
-                cin >> bid;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                Book *book = lib.findBookById(bid);
-                if (book)
-                {
-                    if (book->getStatus() == "Available" ||
-                        (book->getStatus() == "Reserved" && book->getReservedBy() == getId()))
-                    {
-                        book->setStatus("Borrowed");
-                        book->clearReservation();
-                        BorrowRecord rec;
-                        rec.bookId = bid;
-                        rec.borrowTime = time(0);
-                        getAccount().addRecord(rec);
-                        cout << "Book borrowed successfully.\n";
-                    }
-                    else
-                    {
-                        cout << "Book is not available for borrowing.\n";
-                    }
-                }
-                else
-                {
-                    cout << "Book not found.\n";
-                }
+                cout << "Invalid role. User not added.\n";
             }
+            if (added)
+                cout << "New user added: " << uname << " (" << urole << ")\n";
+            break;
         }
-        else if (choice == 3)
+        case 5:
+        {
+            int uid;
+            cout << "Enter User ID to remove: ";
+            cin >> uid;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (lib.removeUser(uid))
+                cout << "User " << uid << " removed. All books borrowed by this user are now marked as available.\n";
+            else
+                cout << "User not found.\n";
+            break;
+        }
+        case 6:
+        {
+            lib.displayAllBooks();
+            break;
+        }
+        case 7:
+        {
+            lib.displayAllUsers();
+            break;
+        }
+        case 8:
+        {
+            lib.displayOverdueLoans(lib.now());
+            break;
+        }
+        case 9:
+        {
+            lib.displayStats();
+            break;
+        }
+        case 10:
+        {
+            runBookQuery(lib);
+            break;
+        }
+        case 11:
+        {
+            cout << "Logging out...\n";
+            break;
+        }
+        default:
+            cout << "Invalid option. Try again.\n";
+            break;
+        }
+        lib.maybeCommit();
+    } while (choice != 11);
+    lib.commitSoon();
+}
+
+// Command Protocol
+// Line-based commands shared by batch mode and server sessions, applied
+// through the same rules as the dashboards:
+//   borrow,<userId>,<bookId>         return,<userId>,<bookId>
+//   reserve,<userId>,<bookId>        payfine,<userId>
+//   addbook,<id>,<title>,<author>,<publisher>,<year>,<isbn>
+//   removebook,<id>                  title,<id>,<new title>
+//   adduser,<id>,<username>,<password>,<Student|Faculty>,<name>
+//   removeuser,<id>                  borrower,<bookId>
+//   query,<filter>[,<filter>...] with filters year=<from>-<to>, author=<name>,
+//                                    isbn=<isbn or prefix*> and available
+// Each command produces one result line, "<line> OK [detail]" or
+// "<line> ERR <reason>".
+class CommandRunner
+{
+private:
+    Library &lib;
+
+    static bool circulation(CircResult status, string &detail)
+    {
+        if (status != CircResult::Ok)
+            detail = describe(status);
+        return status == CircResult::Ok;
+    }
+
+    // Run "query,<filter>,..."; detail lists the matching book IDs
+    bool runQuery(const string_view *f, size_t n, string &detail)
+    {
+        BookQuery query;
+        if (n > 7)
+        {
+            detail = "Too many filters.";
+            return false;
+        }
+        for (size_t i = 1; i < n; ++i)
+        {
+            string_view filter = f[i];
+            size_t eq = filter.find('=');
+            string_view key = filter.substr(0, eq);
+            string_view value = eq == string_view::npos ? string_view() : filter.substr(eq + 1);
+            if (key == "year" && parseYearRange(value, query.yearFrom, query.yearTo))
+                query.byYear = true;
+            else if (key == "author" && !value.empty())
+                query.author = string(value);
+            else if (key == "isbn" && parseIsbnFilter(value, query))
+                continue;
+            else if (filter == "available")
+                query.availableOnly = true;
+            else
+            {
+                detail = "Invalid filter '" + string(filter) + "'.";
+                return false;
+            }
+        }
+        if (!query.hasIndexedFilter())
+        {
+            detail = "Expected query with a year=, author= or isbn= filter.";
+            return false;
+        }
+        vector<int> ids = lib.queryBooks(query);
+        detail = to_string(ids.size()) + " found";
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            detail += i == 0 ? ": " : " ";
+            detail += to_string(ids[i]);
+        }
+        return true;
+    }
+
+public:
+    explicit CommandRunner(Library &lib) : lib(lib) {}
+
+    // True for the commands a patron may issue on their own account
+    static bool isCirculation(string_view cmd)
+    {
+        return cmd == "borrow" || cmd == "return" || cmd == "reserve" || cmd == "payfine";
+    }
+
+    // True for the commands that only read the catalog, open to every patron
+    static bool isCatalogQuery(string_view cmd) { return cmd == "query"; }
+
+    // Apply one command; detail receives the text after OK or ERR
+    bool apply(string_view line, string &detail)
+    {
+        string_view f[7];
+        size_t n = splitFields(line, f, 7);
+        string_view cmd = f[0];
+        int id = 0, other = 0;
+        detail.clear();
+        if (cmd == "query")
+            return runQuery(f, n, detail);
+        if (n < 2 || !parseNumber(f[1], id))
+        {
+            detail = "Missing or invalid ID.";
+            return false;
+        }
+
+        if (cmd == "payfine")
+        {
+            double paid;
+            CircResult status = lib.tryPayFine(id, paid);
+            ostringstream text;
+            text << "paid " << paid;
+            detail = text.str();
+            return circulation(status, detail);
+        }
+        if (isCirculation(cmd))
+        {
+            if (n != 3 || !parseNumber(f[2], other))
+            {
+                detail = "Missing or invalid book ID.";
+                return false;
+            }
+            if (cmd == "borrow")
+                return circulation(lib.tryBorrow(id, other, lib.now()), detail);
+            if (cmd == "reserve")
+                return circulation(lib.tryReserve(id, other), detail);
+            ReturnInfo info = {false, 0, 0};
+            CircResult status = lib.tryReturn(id, other, lib.now(), info);
+            ostringstream text;
+            text << "overdue " << info.overdueDays << " fine " << info.fine;
+            detail = text.str();
+            return circulation(status, detail);
+        }
+        if (cmd == "addbook")
+        {
+            int year;
+            if (n != 7 || !parseNumber(f[5], year))
+                detail = "Expected addbook,<id>,<title>,<author>,<publisher>,<year>,<isbn>.";
+            else if (!lib.addBook(Book(id, unescapeField(f[2]), unescapeField(f[3]), unescapeField(f[4]), year, unescapeField(f[6]))))
+                detail = "Book with ID " + to_string(id) + " already exists.";
+            return detail.empty();
+        }
+        if (cmd == "removebook")
+        {
+            if (!lib.removeBook(id))
+                detail = describe(CircResult::BookNotFound);
+            return detail.empty();
+        }
+        if (cmd == "title")
+        {
+            // The title is the rest of the line and may itself contain commas, escaped or not
+            if (n < 3)
+            {
+                detail = "Expected title,<id>,<new title>.";
+                return false;
+            }
+            if (!lib.updateBookTitle(id, unescapeField(line.substr(f[2].data() - line.data()))))
+                detail = describe(CircResult::BookNotFound);
+            return detail.empty();
+        }
+        if (cmd == "adduser")
+        {
+            UserRole role;
+            if (n != 6 || !parseUserRole(f[4], role) || role == UserRole::Librarian)
+                detail = "Expected adduser,<id>,<username>,<password>,<Student|Faculty>,<name>.";
+            else if (!lib.addUser(role, id, unescapeField(f[2]), unescapeField(f[3]), unescapeField(f[5]), true))
+                detail = "User ID or username already exists.";
+            return detail.empty();
+        }
+        if (cmd == "removeuser")
+        {
+            if (!lib.removeUser(id))
+                detail = describe(CircResult::UserNotFound);
+            return detail.empty();
+        }
+        if (cmd == "borrower")
+        {
+            Borrower borrower;
+            if (lib.findBorrower(id, borrower))
+                detail = "user " + to_string(borrower.userId) + " since " + to_string((long long)borrower.borrowTime);
+            else
+                detail = "none";
+            return true;
+        }
+        detail = "Unknown command.";
+        return false;
+    }
+};
+
+// Append one "<line> OK|ERR [detail]" result line to out
+static void appendResult(string &out, size_t lineNo, bool ok, const string &detail)
+{
+    out += to_string(lineNo);
+    out += ok ? " OK" : " ERR";
+    if (!detail.empty())
+    {
+        out += ' ';
+        out += detail;
+    }
+    out += '\n';
+}
+
+// Batch Mode
+// Runs a file of commands and commits all of their mutations once, at the end
+class BatchRunner
+{
+private:
+    Library &lib;
+    CommandRunner commands;
+    string out;
+    size_t okCount;
+    size_t errCount;
+
+    void flush()
+    {
+        cout.write(out.data(), out.size());
+        out.clear();
+    }
+
+public:
+    explicit BatchRunner(Library &lib) : lib(lib), commands(lib), okCount(0), errCount(0) {}
+
+    void run(string_view text)
+    {
+        string detail;
+        forEachLine(text, 1, [&](string_view line, size_t lineNo) {
+            bool ok = commands.apply(line, detail);
+            appendResult(out, lineNo, ok, detail);
+            if (ok)
+                ++okCount;
+            else
+                ++errCount;
+            if (out.size() >= (1 << 16))
+                flush();
+        });
+        flush();
+        lib.commit();
+        cout.flush();
+        cerr << "Batch complete: " << okCount << " succeeded, " << errCount << " failed.\n";
+        lib.dumpStats(cerr);
+    }
+};
+
+// Server Mode
+// Listens on a Unix domain socket and serves many sessions at once. A
+// session starts with "login,<userId>,<password>" and then sends protocol
+// commands; students and faculty may only issue circulation commands for
+// their own ID, and catalog queries. The main thread polls idle connections
+// and hands readable ones to a pool of worker threads, which run their
+// complete lines and send the results back. Group commits and checkpoints
+// run on the library's background writer thread.
+#ifndef _WIN32
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+class Server
+{
+private:
+    struct Session
+    {
+        int fd;
+        int userId;
+        UserRole role;
+        size_t lineNo;
+        string input;
+    };
+
+    Library &lib;
+    CommandRunner commands;
+    string path;
+
+    // Readable sessions waiting for a worker
+    mutex queueLock;
+    condition_variable queueReady;
+    deque<Session *> ready;
+    bool stopping;
+
+    // Sessions handed back by workers, picked up by the poll loop
+    mutex returnLock;
+    vector<Session *> returned;
+    int wakeFds[2];
+
+    // Authorise and run one command line of a session
+    void handleLine(Session &session, string_view line, string &out)
+    {
+        ++session.lineNo;
+        string_view f[3];
+        size_t n = splitFields(line, f, 3);
+        int id = 0;
+        bool hasId = n >= 2 && parseNumber(f[1], id);
+        string detail;
+        bool ok;
+        if (f[0] == "login")
         {
-            int bid;
-            cout << "Enter Book ID to return: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            bool found = false;
-            auto &records = getAccount().getRecords();
-            for (auto it = records.begin(); it != records.end(); ++it)
+            UserRole role;
+            ok = n == 3 && hasId && lib.authenticate(id, unescapeField(f[2]), role);
+            if (ok)
             {
-                if (it->bookId == bid)
-                {
-                    time_t now = time(0);
-                    double days = difftime(now, it->borrowTime) / (10);
-                    if (days > STUDENT_BORROW_PERIOD)
-                    {
-                        int overdue = days - STUDENT_BORROW_PERIOD;
-                        getAccount().addFine(overdue * STUDENT_FINE_PER_DAY);
-                        cout << "Book returned overdue by " << overdue
-                             << " days. Fine incurred: " << overdue * STUDENT_FINE_PER_DAY << " rupees.\n";
-                    }
-                    else
-                    {
-                        cout << "Book returned on time.\n";
-                    }
-                    records.erase(it);
-                    Book *book = lib.findBookById(bid);
-                    if (book)
-                    {
-                        if (book->getReservedBy() != -1)
-                            book->setStatus("Reserved");
-                        else
-                            book->setStatus("Available");
-                    }
-                    found = true;
-                    break;
-                }
+                session.userId = id;
+                session.role = role;
+                detail = toString(role);
             }
-            if (!found)
-                cout << "Book not found in your borrowed list.\n";
-        }
-        else if (choice == 4)
-        {
-            cout << "Your Borrowed Books:\n";
-            for (auto &rec : getAccount().getRecords())
+            else
             {
-                cout << "Book ID: " << rec.bookId << " Borrowed on: " << ctime(&rec.borrowTime);
+                detail = "Invalid credentials.";
             }
         }
-        else if (choice == 5)
+        else if (session.userId == -1)
         {
-            cout << "Total fine: " << getAccount().getFine() << " rupees.\n";
+            ok = false;
+            detail = "Please log in first.";
         }
-        else if (choice == 6)
+        else if (session.role != UserRole::Librarian &&
+                 !CommandRunner::isCatalogQuery(f[0]) &&
+                 (!CommandRunner::isCirculation(f[0]) || (hasId && id != session.userId)))
         {
-            if (getAccount().getFine() > 0)
-            {
-                cout << "Paying fine of " << getAccount().getFine() << " rupees. Fine cleared.\n";
-                getAccount().clearFine();
-            }
-            else
-            {
-                cout << "No fine to pay.\n";
-            }
+            ok = false;
+            detail = describe(CircResult::NotAllowed);
         }
-        else if (choice == 7)
+        else
         {
-            int bid;
-            cout << "Enter Book ID to reserve: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            Book *book = lib.findBookById(bid);
-            if (book)
-            {
-                if (book->getStatus() == "Borrowed" && book->getReservedBy() == -1)
-                {
-                    book->setReservedBy(getId());
-                    cout << "Book reserved successfully. Upon return, it will be available only for you.\n";
-                }
-                else if (book->getReservedBy() != -1)
-                {
-                    cout << "Book is already reserved.\n";
-                }
-                else
-                {
-                    cout << "Book is available. No need to reserve.\n";
-                }
-            }
-            else
-            {
-                cout << "Book not found.\n";
-            }
+            ok = commands.apply(line, detail);
+            // Hold back the session producing mutations, not the poll loop,
+            // when the writer falls behind
+            if (!CommandRunner::isCatalogQuery(f[0]))
+                lib.maybeCommit();
         }
-        lib.saveData();
-    } while (choice != 8);
-}
+        appendResult(out, session.lineNo, ok, detail);
+    }
 
-// Faculty Dashboard
-void Faculty::dashboard(Library &lib)
-{
-    int choice;
-    do
+    // Read what a readable session has sent and answer its complete lines.
+    // Returns false once the connection is closed.
+    bool serve(Session &session)
     {
-        cout << "\n--- FACULTY DASHBOARD (" << getName() << ") ---\n";
-        cout << "1. View Available Books\n";
-        cout << "2. Borrow a Book\n";
-        cout << "3. Return a Book\n";
-        cout << "4. View Borrowed Books\n";
-        cout << "5. Check Borrowing Status\n";
-        cout << "6. Reserve a Book\n";
-        cout << "7. Logout\n";
-        cout << "Enter your choice: ";
-        cin >> choice;
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        char buffer[1 << 16];
+        ssize_t got = read(session.fd, buffer, sizeof(buffer));
+        if (got <= 0)
+            return false;
+        session.input.append(buffer, got);
 
-        if (choice == 1)
+        string out;
+        size_t start = 0, end;
+        while ((end = session.input.find('\n', start)) != string::npos)
         {
-            lib.displayAvailableBooksForUser(getId());
+            string_view line(session.input.data() + start, end - start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            if (!line.empty())
+                handleLine(session, line, out);
+            start = end + 1;
         }
-        else if (choice == 2)
+        session.input.erase(0, start);
+
+        for (size_t sent = 0; sent < out.size();)
         {
-            bool canBorrow = true;
-            time_t now = time(0);
-            for (auto &rec : getAccount().getRecords())
+            ssize_t n = write(session.fd, out.data() + sent, out.size() - sent);
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    void worker()
+    {
+        while (true)
+        {
+            Session *session;
             {
-                double days = difftime(now, rec.borrowTime) / (10);
-                if (days > FACULTY_OVERDUE_LIMIT)
-                {
-                    canBorrow = false;
-                    break;
-                }
+                unique_lock<mutex> lock(queueLock);
+                queueReady.wait(lock, [this] { return stopping || !ready.empty(); });
+                if (ready.empty())
+                    return;
+                session = ready.front();
+                ready.pop_front();
             }
-            if (!canBorrow)
+            if (!serve(*session))
             {
-                cout << "One of your loans is overdue by more than 60 days. Cannot borrow new books.\n";
+                close(session->fd);
+                delete session;
+                continue;
             }
-            else if (getAccount().getRecords().size() >= FACULTY_MAX_BORROW)
             {
-                cout << "Borrowing limit reached.\n";
+                lock_guard<mutex> lock(returnLock);
+                returned.push_back(session);
             }
-            else
+            char wake = 1;
+            if (write(wakeFds[1], &wake, 1) < 0)
+                cerr << "Warning: cannot wake the server loop.\n";
+        }
+    }
+
+public:
+    Server(Library &lib, const string &path) : lib(lib), commands(lib), path(path), stopping(false) {}
+
+    int run()
+    {
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (listener < 0 || path.size() >= sizeof(addr.sun_path) || pipe(wakeFds) != 0)
+        {
+            cerr << "Error: Cannot create server socket " << path << ".\n";
+            return 1;
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0)
+        {
+            cerr << "Error: Cannot listen on " << path << ".\n";
+            return 1;
+        }
+
+        // Stop cleanly on SIGINT/SIGTERM; poll() is interrupted rather than restarted
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = requestStop;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        unsigned workerCount = max(2u, loadThreadCount());
+        lib.startWriter();
+        vector<thread> workers;
+        for (unsigned i = 0; i < workerCount; ++i)
+            workers.emplace_back(&Server::worker, this);
+        cout << "Serving on " << path << " with " << workerCount << " workers.\n";
+        cout.flush();
+
+        vector<Session *> idle;
+        vector<pollfd> fds;
+        while (!stopRequested)
+        {
+            fds.clear();
+            fds.push_back(pollfd{listener, POLLIN, 0});
+            fds.push_back(pollfd{wakeFds[0], POLLIN, 0});
+            for (Session *session : idle)
+                fds.push_back(pollfd{session->fd, POLLIN, 0});
+            int events = poll(fds.data(), fds.size(), GROUP_COMMIT_MAX_DELAY_MS);
+
+            if (events > 0)
             {
-                int bid;
-                cout << "Enter Book ID to borrow: ";
-                cin >> bid;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                Book *book = lib.findBookById(bid);
-                if (book)
+                // Hand readable (or hung up) sessions to the workers
+                vector<Session *> still;
+                for (size_t i = 0; i < idle.size(); ++i)
                 {
-                    if (book->getStatus() == "Available" ||
-                        (book->getStatus() == "Reserved" && book->getReservedBy() == getId()))
-                    {
-                        book->setStatus("Borrowed");
-                        book->clearReservation();
-                        BorrowRecord rec;
-                        rec.bookId = bid;
-                        rec.borrowTime = time(0);
-                        getAccount().addRecord(rec);
-                        cout << "Book borrowed successfully.\n";
-                    }
-                    else
+                    if (fds[i + 2].revents == 0)
                     {
-                        cout << "Book is not available for borrowing.\n";
+                        still.push_back(idle[i]);
+                        continue;
                     }
+                    lock_guard<mutex> lock(queueLock);
+                    ready.push_back(idle[i]);
+                    queueReady.notify_one();
                 }
-                else
+                idle.swap(still);
+
+                if (fds[1].revents & POLLIN)
                 {
-                    cout << "Book not found.\n";
+                    char drain[256];
+                    if (read(wakeFds[0], drain, sizeof(drain)) < 0)
+                        cerr << "Warning: cannot read the wake pipe.\n";
+                    lock_guard<mutex> lock(returnLock);
+                    idle.insert(idle.end(), returned.begin(), returned.end());
+                    returned.clear();
                 }
-            }
-        }
-        else if (choice == 3)
-        {
-            int bid;
-            cout << "Enter Book ID to return: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            bool found = false;
-            auto &records = getAccount().getRecords();
-            for (auto it = records.begin(); it != records.end(); ++it)
-            {
-                if (it->bookId == bid)
+
+                if (fds[0].revents & POLLIN)
                 {
-                    time_t now = time(0);
-                    double days = difftime(now, it->borrowTime) / (10);
-                    if (days > FACULTY_BORROW_PERIOD)
-                    {
-                        cout << "Book returned late. Overdue by " << (int)(days - FACULTY_BORROW_PERIOD) << " days.\n";
-                    }
-                    else
-                    {
-                        cout << "Book returned on time.\n";
-                    }
-                    records.erase(it);
-                    Book *book = lib.findBookById(bid);
-                    if (book)
-                    {
-                        if (book->getReservedBy() != -1)
-                            book->setStatus("Reserved");
-                        else
-                            book->setStatus("Available");
-                    }
-                    found = true;
-                    break;
+                    int fd = accept(listener, nullptr, nullptr);
+                    if (fd >= 0)
+                        idle.push_back(new Session{fd, -1, UserRole::Student, 0, string()});
                 }
             }
-            if (!found)
-                cout << "Book not found in your borrowed list.\n";
         }
-        else if (choice == 4)
+
         {
-            cout << "Your Borrowed Books:\n";
-            for (auto &rec : getAccount().getRecords())
-            {
-                cout << "Book ID: " << rec.bookId << " Borrowed on: " << ctime(&rec.borrowTime);
-            }
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
         }
-        else if (choice == 5)
+        queueReady.notify_all();
+        for (auto &t : workers)
+            t.join();
+        for (Session *session : ready)
+            idle.push_back(session);
+        for (Session *session : returned)
+            idle.push_back(session);
+        for (Session *session : idle)
         {
-            cout << "Currently borrowed: " << getAccount().getRecords().size() << " books.\n";
+            close(session->fd);
+            delete session;
         }
-        else if (choice == 6)
+        close(listener);
+        close(wakeFds[0]);
+        close(wakeFds[1]);
+        unlink(path.c_str());
+        lib.stopWriter();
+        lib.checkpoint();
+        cout << "Server stopped.\n";
+        lib.dumpStats(cout);
+        return 0;
+    }
+};
+#endif
+
+// Synthetic Data
+// Writes a reproducible catalog, user list and loan history in the text
+// snapshot format, for benchmarks and load testing. About half the books
+// are out on loan, some of those are reserved, and loans are spread over
+// the last few months so that some are overdue.
+static const char *const GEN_TITLE_WORDS[] = {
+    "River", "Shadow", "Light", "Garden", "Empire", "Silent", "Golden", "Journey", "Monsoon", "City",
+    "Stories", "Night", "Ocean", "Mountain", "Secret", "Lost", "Second", "Village", "Fire", "Memory",
+    "Kingdom", "Music", "Glass", "Hidden", "Desert", "Songs", "Winter", "Story", "Bridge", "Train",
+    "Temple", "Letters", "Dream", "Storm", "Island", "Forest", "Market", "Stars", "House", "Road"};
+static const char *const GEN_FIRST_NAMES[] = {
+    "Aarav", "Priya", "Rahul", "Ananya", "Vikram", "Meera", "Arjun", "Kavya", "Rohan", "Divya",
+    "Sanjay", "Lakshmi", "Kiran", "Neha", "Suresh", "Pooja", "Amit", "Sneha", "Ravi", "Asha"};
+static const char *const GEN_LAST_NAMES[] = {
+    "Sharma", "Iyer", "Reddy", "Nair", "Gupta", "Menon", "Rao", "Patel", "Singh", "Das",
+    "Kumar", "Joshi", "Mehta", "Bose", "Pillai", "Verma", "Chatterjee", "Naidu", "Kapoor", "Shetty"};
+static const char *const GEN_PUBLISHERS[] = {
+    "Penguin India", "HarperCollins India", "Rupa Publications", "Macmillan", "Orient Blackswan",
+    "National Book Trust", "Sahitya Akademi", "Oxford University Press", "Westland", "Aleph Book Company"};
+
+template <typename T, size_t N>
+static const T &pick(const T (&items)[N], mt19937_64 &rng)
+{
+    return items[rng() % N];
+}
+
+static bool makeDirectory(const string &path)
+{
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Buffered writer for large generated files
+class BulkFile
+{
+private:
+    FILE *file;
+    string buffer;
+
+public:
+    explicit BulkFile(const string &path) : file(fopen(path.c_str(), "wb")) {}
+    ~BulkFile() { close(); }
+
+    bool isOpen() const { return file != nullptr; }
+
+    BulkFile &operator<<(const string &text)
+    {
+        buffer += text;
+        if (buffer.size() >= (1 << 20))
+            flushBuffer();
+        return *this;
+    }
+
+    void flushBuffer()
+    {
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+
+    void close()
+    {
+        if (file == nullptr)
+            return;
+        flushBuffer();
+        fclose(file);
+        file = nullptr;
+    }
+};
+
+struct GeneratedSizes
+{
+    size_t books = 0;
+    size_t users = 0;
+    size_t loans = 0;
+};
+
+// Generate bookCount books and userCount users (one librarian, the rest
+// students and every tenth a faculty member) into dir. Returns false if the
+// files cannot be written.
+static bool generateLibrary(const string &dir, size_t bookCount, size_t userCount, GeneratedSizes &sizes, uint64_t seed = 42)
+{
+    if (!makeDirectory(dir))
+    {
+        cout << "Error: Cannot create directory " << dir << ".\n";
+        return false;
+    }
+    mt19937_64 rng(seed);
+    time_t now = time(0);
+    userCount = max<size_t>(userCount, 2);
+
+    // Loans first, so books can be written with their final status
+    vector<uint8_t> status(bookCount, (uint8_t)BookStatus::Available);
+    vector<int32_t> reservedBy(bookCount, -1);
+    BulkFile users(dir + "/users.txt");
+    BulkFile fines(dir + "/fines.txt");
+    if (!users.isOpen() || !fines.isOpen())
+    {
+        cout << "Error: Cannot write the generated data files in " << dir << ".\n";
+        return false;
+    }
+    users << "1,librarian,pass,Librarian,Head Librarian\n";
+    size_t onLoan = 0;
+    for (size_t i = 1; i < userCount; ++i)
+    {
+        int uid = (int)(1000 + i);
+        bool faculty = i % 10 == 0;
+        string id = to_string(uid);
+        users << id + ",user" + to_string(i) + ",pass," + (faculty ? "Faculty," : "Student,") +
+                     pick(GEN_FIRST_NAMES, rng) + " " + pick(GEN_LAST_NAMES, rng) + "\n";
+
+        int maxLoans = faculty ? FACULTY_MAX_BORROW : STUDENT_MAX_BORROW;
+        int period = faculty ? FACULTY_BORROW_PERIOD : STUDENT_BORROW_PERIOD;
+        int loans = bookCount == 0 ? 0 : (int)(rng() % (maxLoans + 1));
+        for (int k = 0; k < loans && onLoan * 2 < bookCount; ++k)
         {
-            int bid;
-            cout << "Enter Book ID to reserve: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            Book *book = lib.findBookById(bid);
-            if (book)
+            size_t slot = rng() % bookCount;
+            if (status[slot] != (uint8_t)BookStatus::Available)
+                continue;
+            status[slot] = (uint8_t)BookStatus::Borrowed;
+            ++onLoan;
+            ++sizes.loans;
+            time_t borrowed = now - (time_t)(rng() % ((period + 20) * SECONDS_PER_DAY));
+            fines << id + "," + to_string(slot + 1) + "," + to_string((long long)borrowed) + "\n";
+
+            // A few borrowed books are held for the next user in line
+            if (rng() % 20 == 0 && i + 1 < userCount)
+                reservedBy[slot] = uid + 1;
+        }
+        int fine = (!faculty && rng() % 10 == 0) ? (int)(rng() % 10 + 1) * STUDENT_FINE_PER_DAY : 0;
+        fines << id + ",FINE," + to_string(fine) + "\n";
+    }
+    users.close();
+    fines.close();
+
+    BulkFile books(dir + "/books.txt");
+    if (!books.isOpen())
+    {
+        cout << "Error: Cannot write the generated data files in " << dir << ".\n";
+        return false;
+    }
+    for (size_t slot = 0; slot < bookCount; ++slot)
+    {
+        string title = pick(GEN_TITLE_WORDS, rng);
+        int words = 1 + (int)(rng() % 3);
+        for (int w = 0; w < words; ++w)
+            title += string(" ") + pick(GEN_TITLE_WORDS, rng);
+        string isbn = "978";
+        for (int d = 0; d < 9; ++d)
+            isbn += (char)('0' + rng() % 10);
+        int sum = 0;
+        for (int d = 0; d < 12; ++d)
+            sum += (isbn[d] - '0') * (d % 2 ? 3 : 1);
+        isbn += (char)('0' + (10 - sum % 10) % 10);
+        books << to_string(slot + 1) + "," + title + "," + pick(GEN_FIRST_NAMES, rng) + " " + pick(GEN_LAST_NAMES, rng) +
+                     "," + pick(GEN_PUBLISHERS, rng) + "," + to_string(1850 + rng() % 175) + "," + isbn + "," +
+                     toString((BookStatus)status[slot]) + "," + to_string(reservedBy[slot]) + "\n";
+    }
+    books.close();
+
+    // Start from the snapshot alone
+    remove((dir + "/journal.txt").c_str());
+    remove((dir + "/library.bin").c_str());
+    remove((dir + "/manifest.txt").c_str());
+    sizes.books = bookCount;
+    sizes.users = userCount;
+    return true;
+}
+
+// Benchmark
+// Generates a library, times the core operations against it and writes the
+// results as JSON, so runs from different builds can be compared.
+class Benchmark
+{
+private:
+    struct Result
+    {
+        string name;
+        size_t ops;
+        size_t ok;
+        double ms;
+    };
+
+    // Swallows listing output while it is being timed
+    struct NullBuffer : streambuf
+    {
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char *, streamsize n) override { return n; }
+    };
+
+    vector<Result> results;
+    mt19937_64 rng;
+
+    template <typename Fn>
+    void measure(const string &name, size_t ops, Fn fn)
+    {
+        auto start = chrono::steady_clock::now();
+        size_t ok = fn();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        results.push_back(Result{name, ops, ok, ms});
+        cerr << "  " << name << ": " << ops << " ops in " << ms << " ms\n";
+    }
+
+    template <typename Fn>
+    void measureQuietly(const string &name, Fn fn)
+    {
+        NullBuffer sink;
+        streambuf *saved = cout.rdbuf(&sink);
+        measure(name, 1, fn);
+        cout.rdbuf(saved);
+    }
+
+public:
+    Benchmark() : rng(7) {}
+
+    int run(const string &dir, size_t bookCount, size_t userCount, const string &outFile)
+    {
+        cerr << "Benchmarking " << bookCount << " books and " << userCount << " users in " << dir << "\n";
+        GeneratedSizes sizes;
+        bool generated = false;
+        measure("generate", 1, [&]() { return (size_t)(generated = generateLibrary(dir, bookCount, userCount, sizes)); });
+        if (!generated)
+            return 1;
+
+        Library lib;
+        lib.setDataDir(dir);
+        measureQuietly("load_text", [&]() {
+            lib.loadData();
+            return (size_t)1;
+        });
+
+        const size_t lookups = 1000000;
+        measure("find_book_by_id", lookups, [&]() {
+            size_t found = 0;
+            for (size_t i = 0; i < lookups; ++i)
+                found += (bool)lib.findBookById((int)(rng() % (bookCount + bookCount / 10 + 1)) + 1);
+            return found;
+        });
+
+        const size_t queries = 1000;
+        measure("search", queries, [&]() {
+            size_t hits = 0;
+            for (size_t i = 0; i < queries; ++i)
+                hits += lib.searchBooks(string(pick(GEN_TITLE_WORDS, rng)) + " " + pick(GEN_TITLE_WORDS, rng)).size();
+            return hits;
+        });
+
+        // Circulation through the same rules as the dashboards, for random patrons and books
+        size_t flows = min<size_t>(100000, max<size_t>(userCount, 1) * 2);
+        vector<pair<int, int>> borrowed;
+        time_t now = lib.now();
+        auto randomUser = [&]() { return (int)(1001 + rng() % max<size_t>(userCount - 1, 1)); };
+        measure("borrow", flows, [&]() {
+            for (size_t i = 0; i < flows; ++i)
             {
-                if (book->getStatus() == "Borrowed" && book->getReservedBy() == -1)
-                {
-                    book->setReservedBy(getId());
-                    cout << "Book reserved successfully. Upon return, it will be available only for you.\n";
-                }
-                else if (book->getReservedBy() != -1)
-                {
-                    cout << "Book is already reserved.\n";
-                }
-                else
-                {
-                    cout << "Book is available. No need to reserve.\n";
-                }
+                int uid = randomUser();
+                int bid = (int)(rng() % max<size_t>(bookCount, 1)) + 1;
+                if (lib.tryBorrow(uid, bid, now) == CircResult::Ok)
+                    borrowed.emplace_back(uid, bid);
             }
-            else
+            return borrowed.size();
+        });
+        measure("return", borrowed.size(), [&]() {
+            size_t ok = 0;
+            ReturnInfo info;
+            for (auto &loan : borrowed)
+                ok += lib.tryReturn(loan.first, loan.second, now, info) == CircResult::Ok;
+            return ok;
+        });
+        measure("reserve", flows, [&]() {
+            size_t ok = 0;
+            for (size_t i = 0; i < flows; ++i)
+                ok += lib.tryReserve(randomUser(), (int)(rng() % max<size_t>(bookCount, 1)) + 1) == CircResult::Ok;
+            return ok;
+        });
+
+        measureQuietly("list_available", [&]() {
+            lib.displayAvailableBooks();
+            return (size_t)1;
+        });
+        measureQuietly("list_all_books", [&]() {
+            lib.displayAllBooks();
+            return (size_t)1;
+        });
+        measureQuietly("list_overdue", [&]() {
+            lib.displayOverdueLoans(now);
+            return (size_t)1;
+        });
+        measure("fine_sweep", 1, [&]() { return lib.sweep(now).rows.size(); });
+
+        measure("journal_commit", 1, [&]() {
+            lib.commit();
+            return (size_t)1;
+        });
+        measureQuietly("save_text", [&]() {
+            lib.saveAll();
+            return (size_t)1;
+        });
+        lib.setBinaryFormat(true);
+        measureQuietly("save_binary", [&]() {
+            lib.saveAll();
+            return (size_t)1;
+        });
+        Library binary;
+        binary.setDataDir(dir);
+        binary.setBinaryFormat(true);
+        measureQuietly("load_binary", [&]() {
+            binary.loadData();
+            return (size_t)1;
+        });
+
+        return writeResults(outFile, sizes) ? 0 : 1;
+    }
+
+    bool writeResults(const string &outFile, const GeneratedSizes &sizes) const
+    {
+        ofstream out(outFile);
+        if (!out)
+        {
+            cout << "Error: Cannot open " << outFile << " for writing.\n";
+            return false;
+        }
+#if defined(__VERSION__)
+        const char *compiler = __VERSION__;
+#else
+        const char *compiler = "unknown";
+#endif
+        out << "{\n";
+        out << "  \"timestamp\": " << (long long)time(0) << ",\n";
+        out << "  \"compiler\": \"" << compiler << "\",\n";
+        out << "  \"threads\": " << loadThreadCount() << ",\n";
+        out << "  \"books\": " << sizes.books << ",\n";
+        out << "  \"users\": " << sizes.users << ",\n";
+        out << "  \"loans\": " << sizes.loans << ",\n";
+        out << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result &r = results[i];
+            double nsPerOp = r.ops ? r.ms * 1e6 / r.ops : 0;
+            out << "    {\"name\": \"" << r.name << "\", \"ops\": " << r.ops << ", \"ok\": " << r.ok << ", \"ms\": " << r.ms
+                << ", \"ns_per_op\": " << nsPerOp << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        cout << "Benchmark results written to " << outFile << ".\n";
+        return true;
+    }
+};
+
+// Simulator
+// Discrete-event simulation of circulation on a simulated calendar. Patrons
+// visit at random intervals to pay fines, borrow and reserve, and bring
+// books back early or late; a reserved book is picked up soon after it is
+// returned. Every event goes through the same rules as the dashboards,
+// against an in-memory library that is never saved. Runs depend only on
+// the seed and sizes, and end with throughput and a checksum of the final
+// state so that builds and policy changes can be compared.
+class Simulator
+{
+private:
+    enum class EventType : uint8_t
+    {
+        Visit,
+        Return,
+        Pickup
+    };
+
+    struct Event
+    {
+        time_t at;
+        uint64_t seq; // breaks ties so equal times pop in a fixed order
+        EventType type;
+        int userId;
+        int bookId;
+    };
+
+    struct Later
+    {
+        bool operator()(const Event &a, const Event &b) const { return a.at != b.at ? a.at > b.at : a.seq > b.seq; }
+    };
+
+    // Counted per kind of circulation request
+    struct Tally
+    {
+        const char *name;
+        size_t attempts;
+        size_t ok;
+    };
+
+    // Simulated calendar start, fixed so runs are reproducible
+    static const time_t START = 1700000000;
+    // Patrons come back every 1 to 2 * MEAN_VISIT_DAYS days
+    static const int MEAN_VISIT_DAYS = 7;
+
+    Library lib;
+    ManualClock clock;
+    uint64_t seed;
+    mt19937_64 rng;
+    priority_queue<Event, vector<Event>, Later> events;
+    uint64_t seq;
+    size_t bookCount;
+    size_t userCount;
+    Tally borrows, returns, reserves, payments;
+    double finesCharged;
+    double finesPaid;
+
+    void schedule(time_t at, EventType type, int uid, int bid = 0) { events.push(Event{at, seq++, type, uid, bid}); }
+
+    time_t days(uint64_t n) const { return (time_t)n * SECONDS_PER_DAY; }
+
+    // Half of the requests go to the first tenth of the catalog
+    int randomBook()
+    {
+        size_t range = rng() % 2 ? max<size_t>(bookCount / 10, 1) : bookCount;
+        return (int)(rng() % range) + 1;
+    }
+
+    void populate()
+    {
+        lib.setClock(&clock);
+        lib.setJournalPaused(true);
+        for (size_t i = 0; i < bookCount; ++i)
+        {
+            string title = string(pick(GEN_TITLE_WORDS, rng)) + " " + pick(GEN_TITLE_WORDS, rng);
+            lib.addBook(Book((int)i + 1, title, string(pick(GEN_FIRST_NAMES, rng)) + " " + pick(GEN_LAST_NAMES, rng),
+                             pick(GEN_PUBLISHERS, rng), 1850 + (int)(rng() % 175), "978" + to_string(1000000000 + i)));
+        }
+        for (size_t i = 1; i <= userCount; ++i)
+        {
+            int uid = (int)(1000 + i);
+            lib.addUser(i % 10 == 0 ? UserRole::Faculty : UserRole::Student, uid, "user" + to_string(i), "pass",
+                        string(pick(GEN_FIRST_NAMES, rng)) + " " + pick(GEN_LAST_NAMES, rng));
+            schedule(START + (time_t)(rng() % days(MEAN_VISIT_DAYS)), EventType::Visit, uid);
+        }
+    }
+
+    void borrow(User *user, int bid)
+    {
+        time_t now = clock.now();
+        ++borrows.attempts;
+        CircResult status = lib.tryBorrow(user->getId(), bid, now);
+        if (status == CircResult::Ok)
+        {
+            ++borrows.ok;
+            // Most loans come back in time, one in five up to 20 days late
+            int period = user->getRole() == UserRole::Faculty ? FACULTY_BORROW_PERIOD : STUDENT_BORROW_PERIOD;
+            uint64_t kept = rng() % 5 ? 1 + rng() % period : period + 1 + rng() % 20;
+            schedule(now + days(kept) + (time_t)(rng() % SECONDS_PER_DAY), EventType::Return, user->getId(), bid);
+        }
+        else if (status == CircResult::NotAvailable && rng() % 2)
+        {
+            ++reserves.attempts;
+            reserves.ok += lib.tryReserve(user->getId(), bid) == CircResult::Ok;
+        }
+    }
+
+    void visit(int uid)
+    {
+        User *user = lib.findUserById(uid);
+        if (user->getAccount().getFine() > 0 && rng() % 4)
+        {
+            double paid;
+            ++payments.attempts;
+            if (lib.tryPayFine(uid, paid) == CircResult::Ok)
             {
-                cout << "Book not found.\n";
+                ++payments.ok;
+                finesPaid += paid;
             }
         }
-        lib.saveData();
-    } while (choice != 7);
+        borrow(user, randomBook());
+        schedule(clock.now() + days(1 + rng() % (2 * MEAN_VISIT_DAYS)), EventType::Visit, uid);
+    }
+
+    void giveBack(int uid, int bid)
+    {
+        ReturnInfo info = {false, 0, 0};
+        ++returns.attempts;
+        if (lib.tryReturn(uid, bid, clock.now(), info) != CircResult::Ok)
+            return;
+        ++returns.ok;
+        finesCharged += info.fine;
+        BookHandle book = lib.findBookById(bid);
+        if (book && book->getReservedBy() != -1)
+            schedule(clock.now() + days(rng() % 3) + 1, EventType::Pickup, book->getReservedBy(), bid);
+    }
+
+    static void printTally(const Tally &t)
+    {
+        cout << "  " << left << setw(10) << t.name << right << setw(12) << t.attempts << setw(12) << t.ok << "\n";
+    }
+
+public:
+    Simulator(size_t bookCount, size_t userCount, uint64_t seed)
+        : clock(START), seed(seed), rng(seed), seq(0), bookCount(max<size_t>(bookCount, 1)), userCount(max<size_t>(userCount, 1)),
+          borrows{"borrow", 0, 0}, returns{"return", 0, 0}, reserves{"reserve", 0, 0}, payments{"payfine", 0, 0},
+          finesCharged(0), finesPaid(0) {}
+
+    void run(size_t eventCount)
+    {
+        populate();
+        auto start = chrono::steady_clock::now();
+        size_t processed = 0;
+        for (; processed < eventCount && !events.empty(); ++processed)
+        {
+            Event event = events.top();
+            events.pop();
+            clock.set(event.at);
+            if (event.type == EventType::Visit)
+                visit(event.userId);
+            else if (event.type == EventType::Return)
+                giveBack(event.userId, event.bookId);
+            else
+                borrow(lib.findUserById(event.userId), event.bookId);
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        size_t openLoans = 0;
+        for (auto user : lib.getUsers())
+            openLoans += user->getAccount().getRecords().size();
+        cout << "Simulated " << processed << " events over " << (clock.now() - START) / SECONDS_PER_DAY << " days ("
+             << bookCount << " books, " << userCount << " users, seed " << seed << ") in " << fixed << setprecision(1)
+             << ms << " ms: " << setprecision(0) << (ms > 0 ? processed / ms * 1000 : 0) << " events/s\n";
+        cout << "  " << left << setw(10) << "request" << right << setw(12) << "attempts" << setw(12) << "ok" << "\n";
+        printTally(borrows);
+        printTally(returns);
+        printTally(reserves);
+        printTally(payments);
+        cout << "Fines charged: " << finesCharged << ", paid: " << finesPaid << ". Open loans at end: " << openLoans << "\n";
+        cout << "State checksum: " << hex << setw(16) << setfill('0') << lib.stateChecksum() << dec << setfill(' ') << "\n";
+        cout.unsetf(ios::fixed);
+        cout << setprecision(6);
+        lib.dumpStats(cout);
+    }
+};
+
+// Session Recording
+// Captures an interactive session so it can be replayed later. A session
+// directory holds the data files the session started from (data/), every
+// input line with when it arrived (session.trace) and everything printed
+// (output.txt). Each trace line is "<ms since previous line> <clock seconds
+// since previous line> <input>". The library clock only moves when a line
+// is read, so a replay that feeds the same lines to a copy of the data runs
+// at full speed and prints exactly the same output.
+const char *const SESSION_DATA_FILES[] = {"books.txt", "users.txt", "fines.txt", "library.bin", "journal.txt", "manifest.txt"};
+
+static bool copyFile(const string &from, const string &to)
+{
+    ifstream in(from, ios::binary);
+    if (!in)
+        return false;
+    ofstream out(to, ios::binary);
+    out << in.rdbuf();
+    return (bool)out;
 }
 
-// Librarian Dashboard
-void Librarian::dashboard(Library &lib)
+// Input buffer that serves one line at a time, setting the session clock
+// before each line is handed out
+class SessionInput : public streambuf
 {
-    int choice;
-    do
+private:
+    istream &source;
+    ostream *trace;   // recording: where lines are logged
+    ManualClock &clock;
+    string line;
+    size_t lines;
+    chrono::steady_clock::time_point last;
+    time_t lastClock;
+
+    int underflow() override
     {
-        cout << "\n--- LIBRARIAN DASHBOARD (" << getName() << ") ---\n";
-        cout << "1. Add a New Book\n";
-        cout << "2. Remove a Book\n";
-        cout << "3. Update Book Information\n";
-        cout << "4. Add a New User\n";
-        cout << "5. Remove a User\n";
-        cout << "6. View All Books\n";
-        cout << "7. View All Users\n";
-        cout << "8. Logout\n";
-        cout << "Enter your choice: ";
-        cin >> choice;
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        switch (choice)
-        {
-        case 1:
+        if (!nextLine())
+            return traits_type::eof();
+        line += '\n';
+        setg(&line[0], &line[0], &line[0] + line.size());
+        ++lines;
+        return traits_type::to_int_type(line[0]);
+    }
+
+    bool nextLine()
+    {
+        if (trace == nullptr)
         {
-            cout << "Enter new book details:\n";
-            int bid, pubYear;
-            string title, author, publisher, isbn;
-            cout << "ID: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            if (lib.bookExists(bid))
-            {
-                cout << "Book with ID " << bid << " already exists. Cannot add duplicate book.\n";
-                break;
-            }
-            cout << "Title: ";
-            getline(cin, title);
-            cout << "Author: ";
-            getline(cin, author);
-            cout << "Publisher: ";
-            getline(cin, publisher);
-            cout << "Year: ";
-            cin >> pubYear;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "ISBN: ";
-            getline(cin, isbn);
-            lib.getBooks().push_back(Book(bid, title, author, publisher, pubYear, isbn, "Available", -1));
-            cout << "New book added: " << title << "\n";
-            break;
+            // Replay: take the next recorded line and its clock
+            long long ms, seconds;
+            if (!(source >> ms >> seconds) || source.get() != ' ' || !getline(source, line))
+                return false;
+            lastClock += (time_t)seconds;
+            clock.set(lastClock);
+            return true;
         }
-        case 2:
+        if (!getline(source, line))
+            return false;
+        auto now = chrono::steady_clock::now();
+        time_t wall = time(0);
+        *trace << chrono::duration_cast<chrono::milliseconds>(now - last).count() << " " << (long long)(wall - lastClock)
+               << " " << line << "\n";
+        last = now;
+        lastClock = wall;
+        clock.set(wall);
+        return true;
+    }
+
+public:
+    SessionInput(istream &source, ostream *trace, ManualClock &clock, time_t start)
+        : source(source), trace(trace), clock(clock), lines(0), last(chrono::steady_clock::now()), lastClock(start) {}
+
+    size_t lineCount() const { return lines; }
+};
+
+// Output buffer that keeps a copy of everything written, and optionally
+// passes it on
+class SessionOutput : public streambuf
+{
+private:
+    streambuf *echo;
+    string text;
+
+    int overflow(int c) override
+    {
+        if (c != traits_type::eof())
         {
-            int bid;
-            cout << "Enter Book ID to remove: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            bool removed = false;
-            for (auto it = lib.getBooks().begin(); it != lib.getBooks().end(); ++it)
-            {
-                if (it->getId() == bid)
-                {
-                    lib.getBooks().erase(it);
-                    removed = true;
-                    cout << "Book " << bid << " removed.\n";
-                    break;
-                }
-            }
-            if (!removed)
-                cout << "Book not found.\n";
-            break;
+            text += (char)c;
+            if (echo)
+                echo->sputc((char)c);
         }
-        case 3:
+        return c;
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        text.append(s, (size_t)n);
+        if (echo)
+            echo->sputn(s, n);
+        return n;
+    }
+
+    int sync() override { return echo ? echo->pubsync() : 0; }
+
+public:
+    explicit SessionOutput(streambuf *echo) : echo(echo) {}
+    const string &contents() const { return text; }
+};
+
+// Sets up recording or replay around the interactive menus in main()
+class SessionHarness
+{
+private:
+    Library &lib;
+    string dir;
+    bool replaying;
+    ManualClock clock;
+    ifstream traceIn;
+    ofstream traceOut;
+    unique_ptr<istream> console; // the original standard input, while recording
+    unique_ptr<SessionInput> input;
+    unique_ptr<SessionOutput> output;
+    streambuf *savedIn;
+    streambuf *savedOut;
+    chrono::steady_clock::time_point started;
+    long long recordedMs;
+
+    // Copy whichever data files exist from one directory to another
+    static bool copyData(const string &from, const string &to)
+    {
+        if (!makeDirectory(to))
+            return false;
+        for (const char *name : SESSION_DATA_FILES)
         {
-            int bid;
-            cout << "Enter Book ID to update: ";
-            cin >> bid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            string newTitle;
-            cout << "Enter new title: ";
-            getline(cin, newTitle);
-            bool updated = false;
-            for (auto &bk : lib.getBooks())
-            {
-                if (bk.getId() == bid)
-                {
-                    bk.setTitle(newTitle);
-                    updated = true;
-                    cout << "Book " << bid << " updated to: " << newTitle << "\n";
-                    break;
-                }
-            }
-            if (!updated)
-                cout << "Book not found.\n";
-            break;
+            remove((to + "/" + name).c_str());
+            if (fileExists(from + "/" + name) && !copyFile(from + "/" + name, to + "/" + name))
+                return false;
         }
-        case 4:
+        return true;
+    }
+
+    void attach(istream &source, ostream *trace, time_t start, streambuf *echo)
+    {
+        clock.set(start);
+        lib.setClock(&clock);
+        input.reset(new SessionInput(source, trace, clock, start));
+        output.reset(new SessionOutput(echo));
+        savedIn = cin.rdbuf(input.get());
+        savedOut = cout.rdbuf(output.get());
+        started = chrono::steady_clock::now();
+    }
+
+    // Compare the replayed output with the recorded one; true if they match
+    bool compare(const string &expected, const string &actual) const
+    {
+        istringstream a(expected), b(actual);
+        string left, right;
+        size_t lineNo = 0, differing = 0;
+        while (true)
         {
-            cout << "Enter new user details:\n";
-            int uid;
-            string uname, pwd, urole, fname;
-            cout << "ID: ";
-            cin >> uid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            if (lib.userExists(uid))
-            {
-                cout << "User with ID " << uid << " already exists. Cannot add duplicate user.\n";
+            bool more = (bool)getline(a, left);
+            bool moreActual = (bool)getline(b, right);
+            if (!more && !moreActual)
                 break;
-            }
-            cout << "Username: ";
-            getline(cin, uname);
-            cout << "Password: ";
-            getline(cin, pwd);
-            cout << "Role (Student/Faculty): ";
-            getline(cin, urole);
-            cout << "Name: ";
-            getline(cin, fname);
-            bool added = false;
-            if (urole == "Student")
-            {
-                lib.getUsers().push_back(new Student(uid, uname, pwd, fname));
-                added = true;
-            }
-            else if (urole == "Faculty")
-            {
-                lib.getUsers().push_back(new Faculty(uid, uname, pwd, fname));
-                added = true;
-            }
-            else
+            ++lineNo;
+            if (more && moreActual && left == right)
+                continue;
+            if (differing++ < 5)
             {
-                cout << "Invalid role. User not added.\n";
+                cout << "  line " << lineNo << ":\n";
+                cout << "  - " << (more ? left : "<end of output>") << "\n";
+                cout << "  + " << (moreActual ? right : "<end of output>") << "\n";
             }
-            if (added)
-                cout << "New user added: " << uname << " (" << urole << ")\n";
-            break;
         }
-        case 5:
+        if (differing == 0)
+            cout << "Output matches the recorded session.\n";
+        else
+            cout << "Output differs from the recorded session on " << differing << " lines.\n";
+        return differing == 0;
+    }
+
+public:
+    explicit SessionHarness(Library &lib)
+        : lib(lib), replaying(false), clock(0), savedIn(nullptr), savedOut(nullptr), recordedMs(0) {}
+
+    bool active() const { return input != nullptr; }
+
+    // Snapshot the data directory and start logging input and output
+    bool record(const string &sessionDir)
+    {
+        dir = sessionDir;
+        if (!makeDirectory(dir) || !copyData(lib.getDataDir(), dir + "/data"))
         {
-            int uid;
-            cout << "Enter User ID to remove: ";
-            cin >> uid;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            bool removed = false;
-            for (auto it = lib.getUsers().begin(); it != lib.getUsers().end(); ++it)
-            {
-                if ((*it)->getId() == uid)
-                {
-                    for (auto rec : (*it)->getAccount().getRecords())
-                    {
-                        Book *book = lib.findBookById(rec.bookId);
-                        if (book)
-                        {
-                            book->setStatus("Available");
-                            book->clearReservation();
-                        }
-                    }
-                    delete *it;
-                    lib.getUsers().erase(it);
-                    removed = true;
-                    cout << "User " << uid << " removed. All books borrowed by this user are now marked as available.\n";
-                    break;
-                }
-            }
-            if (!removed)
-                cout << "User not found.\n";
-            break;
+            cout << "Error: Cannot create session directory " << dir << ".\n";
+            return false;
         }
-        case 6:
+        traceOut.open(dir + "/session.trace");
+        if (!traceOut)
         {
-            cout << "All Books:\n";
-            for (auto &bk : lib.getBooks())
-                bk.display();
-            break;
+            cout << "Error: Cannot write " << dir << "/session.trace.\n";
+            return false;
         }
-        case 7:
+        time_t start = time(0);
+        traceOut << "LMSTRACE 1 " << (long long)start << "\n";
+        console.reset(new istream(cin.rdbuf()));
+        attach(*console, &traceOut, start, cout.rdbuf());
+        return true;
+    }
+
+    // Point the library at a fresh copy of the recorded data and feed it the
+    // recorded input, with the output captured instead of shown
+    bool replay(const string &sessionDir)
+    {
+        dir = sessionDir;
+        replaying = true;
+        traceIn.open(dir + "/session.trace");
+        string magic;
+        int version = 0;
+        long long start = 0;
+        if (!(traceIn >> magic >> version >> start) || magic != "LMSTRACE" || version != 1)
         {
-            cout << "All Users:\n";
-            for (auto usr : lib.getUsers())
-            {
-                cout << usr->getId() << " - " << usr->getUsername() << " (" << usr->getRole() << ") - " << usr->getName() << "\n";
-            }
-            break;
+            cout << "Error: " << dir << "/session.trace is missing or not a session trace.\n";
+            return false;
         }
-        case 8:
+        traceIn.ignore(numeric_limits<streamsize>::max(), '\n');
+        if (!copyData(dir + "/data", dir + "/replay-data"))
         {
-            cout << "Logging out...\n";
-            break;
+            cout << "Error: Cannot copy " << dir << "/data for the replay.\n";
+            return false;
         }
-        default:
-            cout << "Invalid option. Try again.\n";
-            break;
+        lib.setDataDir(dir + "/replay-data");
+
+        // The recorded think time, reported next to the replay time
+        ifstream scan(dir + "/session.trace");
+        scan.ignore(numeric_limits<streamsize>::max(), '\n');
+        long long ms, seconds;
+        string rest;
+        while (scan >> ms >> seconds && getline(scan, rest))
+            recordedMs += ms;
+
+        attach(traceIn, nullptr, (time_t)start, nullptr);
+        return true;
+    }
+
+    // Stop capturing and write or check the output. Returns false if a
+    // replay did not reproduce the recorded output.
+    bool finish()
+    {
+        if (!active())
+            return true;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        cin.rdbuf(savedIn);
+        cout.rdbuf(savedOut);
+        lib.setClock(nullptr);
+        if (!replaying)
+        {
+            traceOut.close();
+            ofstream out(dir + "/output.txt", ios::binary);
+            out << output->contents();
+            cout << "Session recorded to " << dir << " (" << input->lineCount() << " input lines).\n";
+            return true;
         }
-        lib.saveData();
-    } while (choice != 8);
-}
+        ofstream out(dir + "/replay-output.txt", ios::binary);
+        out << output->contents();
+        out.close();
+        cout << "Replayed " << input->lineCount() << " input lines in " << fixed << setprecision(1) << ms
+             << " ms (the recorded session took " << recordedMs / 1000.0 << " s).\n";
+        cout.unsetf(ios::fixed);
+        cout << setprecision(6);
+        ifstream recorded(dir + "/output.txt", ios::binary);
+        string expected((istreambuf_iterator<char>(recorded)), istreambuf_iterator<char>());
+        return compare(expected, output->contents());
+    }
+};
 
 // Main Function
-int main()
+int main(int argc, char *argv[])
 {
     Library library;
+    string convertTo;
+    bool batch = false;
+    string batchFile;
+    bool serve = false;
+    string socketPath;
+    string sweepMode;
+    string dataDir;
+    size_t generateBooks = 0;
+    size_t benchBooks = 0;
+    size_t userCount = 0;
+    size_t simEvents = 0;
+    size_t simBooks = 0;
+    uint64_t seed = 1;
+    string recordDir;
+    string replayDir;
+    string benchOut = "bench-results.json";
+    ReportOptions reportOptions;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--no-journal")
+            library.setJournalEnabled(false);
+        else if (arg == "--format=binary")
+            library.setBinaryFormat(true);
+        else if (arg == "--format=text")
+            library.setBinaryFormat(false);
+        else if (arg == "--convert-to-binary")
+            convertTo = "binary";
+        else if (arg == "--convert-to-text")
+            convertTo = "text";
+        else if (arg.compare(0, 12, "--page-size=") == 0)
+            reportOptions.pageSize = stoul(arg.substr(12));
+        else if (arg.compare(0, 9, "--offset=") == 0)
+            reportOptions.offset = stoul(arg.substr(9));
+        else if (arg == "--output=tsv")
+            reportOptions.format = ReportFormat::Tsv;
+        else if (arg == "--output=json")
+            reportOptions.format = ReportFormat::JsonLines;
+        else if (arg == "--output=text")
+            reportOptions.format = ReportFormat::Text;
+        else if (arg == "--serve")
+            serve = true;
+        else if (arg.compare(0, 8, "--serve=") == 0)
+        {
+            serve = true;
+            socketPath = arg.substr(8);
+        }
+        else if (arg.compare(0, 11, "--data-dir=") == 0)
+            dataDir = arg.substr(11);
+        else if (arg.compare(0, 11, "--generate=") == 0)
+            generateBooks = stoul(arg.substr(11));
+        else if (arg == "--bench")
+            benchBooks = 10000;
+        else if (arg.compare(0, 8, "--bench=") == 0)
+            benchBooks = stoul(arg.substr(8));
+        else if (arg.compare(0, 8, "--users=") == 0)
+            userCount = stoul(arg.substr(8));
+        else if (arg == "--simulate")
+            simEvents = 1000000;
+        else if (arg.compare(0, 11, "--simulate=") == 0)
+            simEvents = stoul(arg.substr(11));
+        else if (arg.compare(0, 8, "--books=") == 0)
+            simBooks = stoul(arg.substr(8));
+        else if (arg.compare(0, 7, "--seed=") == 0)
+            seed = stoull(arg.substr(7));
+        else if (arg.compare(0, 9, "--record=") == 0)
+            recordDir = arg.substr(9);
+        else if (arg.compare(0, 9, "--replay=") == 0)
+            replayDir = arg.substr(9);
+        else if (arg.compare(0, 12, "--bench-out=") == 0)
+            benchOut = arg.substr(12);
+        else if (arg == "--sweep" || arg == "--sweep=save")
+            sweepMode = arg;
+        else if (arg == "--batch")
+        {
+            batch = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                batchFile = argv[++i];
+        }
+    }
+    library.setReportOptions(reportOptions);
+    if (!dataDir.empty())
+        library.setDataDir(dataDir);
+
+    // Synthetic data: write a generated library into the data directory
+    if (generateBooks > 0)
+    {
+        GeneratedSizes sizes;
+        string dir = dataDir.empty() ? "./data" : dataDir;
+        if (!generateLibrary(dir, generateBooks, userCount ? userCount : max<size_t>(10, generateBooks / 10), sizes))
+            return 1;
+        cout << "Generated " << sizes.books << " books, " << sizes.users << " users and " << sizes.loans << " loans in "
+             << dir << ".\n";
+        return 0;
+    }
+
+    // Benchmark on generated data, kept away from ./data unless asked
+    if (benchBooks > 0)
+    {
+        Benchmark bench;
+        return bench.run(dataDir.empty() ? "./bench-data" : dataDir, benchBooks,
+                         userCount ? userCount : max<size_t>(10, benchBooks / 10), benchOut);
+    }
+
+    // Circulation simulation on a simulated calendar, entirely in memory
+    if (simEvents > 0)
+    {
+        size_t patrons = userCount ? userCount : 10000;
+        Simulator sim(simBooks ? simBooks : patrons * 5, patrons, seed);
+        sim.run(simEvents);
+        return 0;
+    }
+
+    // Format conversion: load the committed snapshot (and journal), or the
+    // files of the other format if no manifest names one, and write it out in
+    // the requested format
+    if (!convertTo.empty())
+    {
+        library.setBinaryFormat(convertTo == "text");
+        library.loadData();
+        library.setBinaryFormat(convertTo == "binary");
+        library.saveAll();
+        cout << "Converted library data to " << convertTo << " format.\n";
+        return 0;
+    }
+
+    // Record the interactive session, or replay a recorded one
+    SessionHarness session(library);
+    if (!recordDir.empty() && !session.record(recordDir))
+        return 1;
+    if (!replayDir.empty() && !session.replay(replayDir))
+        return 1;
+
     library.loadData();
 
+    // Headless batch mode: commands come from a file, or stdin when none is given
+    if (batch)
+    {
+        BatchRunner runner(library);
+        if (batchFile.empty())
+        {
+            string commands((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+            runner.run(commands);
+        }
+        else
+        {
+            MappedFile commands;
+            if (!commands.open(batchFile))
+            {
+                cerr << "Cannot open batch file " << batchFile << ".\n";
+                return 1;
+            }
+            runner.run(commands.view());
+        }
+        return 0;
+    }
+
+    // Nightly fine sweep; --sweep=save also records the accrued fines in fines.txt
+    if (!sweepMode.empty())
+    {
+        SweepResult result = library.sweep(library.now());
+        library.displaySweep(result);
+        if (sweepMode == "--sweep=save")
+            library.saveSweep(result);
+        return 0;
+    }
+
+    // Concurrent server mode for checkout terminals
+    if (serve)
+    {
+#ifdef _WIN32
+        cerr << "Server mode needs Unix domain sockets and is not available on this platform.\n";
+        return 1;
+#else
+        Server server(library, socketPath.empty() ? library.dataPath("library.sock") : socketPath);
+        return server.run();
+#endif
+    }
+
+    // Saving happens in the background while the menus are in use
+    library.startWriter();
     int choice;
     do
     {
@@ -919,6 +6294,9 @@ int main()
         cout << "4. Exit\n";
         cout << "Enter your choice: ";
         cin >> choice;
+        // Input has ended (or is not a number); stop instead of redrawing the menu forever
+        if (!cin)
+            break;
         cin.ignore(numeric_limits<streamsize>::max(), '\n');
 
         if (choice == 1)
@@ -929,19 +6307,16 @@ int main()
             cin >> uid;
             cout << "Enter password: ";
             cin >> pwd;
-            bool loggedIn = false;
-            for (auto user : library.getUsers())
+            User *user = library.login(uid, pwd);
+            if (user && user->getRole() == UserRole::Student)
             {
-                if (user->getRole() == "Student" && user->getId() == uid && user->getPassword() == pwd)
-                {
-                    cout << "Login successful. Welcome " << user->getName() << "!\n";
-                    user->dashboard(library);
-                    loggedIn = true;
-                    break;
-                }
+                cout << "Login successful. Welcome " << user->getName() << "!\n";
+                user->dashboard(library);
             }
-            if (!loggedIn)
+            else
+            {
                 cout << "Invalid credentials.\n";
+            }
         }
         else if (choice == 2)
         {
@@ -951,19 +6326,16 @@ int main()
             cin >> uid;
             cout << "Enter password: ";
             cin >> pwd;
-            bool loggedIn = false;
-            for (auto user : library.getUsers())
+            User *user = library.login(uid, pwd);
+            if (user && user->getRole() == UserRole::Faculty)
             {
-                if (user->getRole() == "Faculty" && user->getId() == uid && user->getPassword() == pwd)
-                {
-                    cout << "Login successful. Welcome " << user->getName() << "!\n";
-                    user->dashboard(library);
-                    loggedIn = true;
-                    break;
-                }
+                cout << "Login successful. Welcome " << user->getName() << "!\n";
+                user->dashboard(library);
             }
-            if (!loggedIn)
+            else
+            {
                 cout << "Invalid credentials.\n";
+            }
         }
         else if (choice == 3)
         {
@@ -973,19 +6345,16 @@ int main()
             cin >> uid;
             cout << "Enter password: ";
             cin >> pwd;
-            bool loggedIn = false;
-            for (auto user : library.getUsers())
+            User *user = library.login(uid, pwd);
+            if (user && user->getRole() == UserRole::Librarian)
             {
-                if (user->getRole() == "Librarian" && user->getId() == uid && user->getPassword() == pwd)
-                {
-                    cout << "Login successful. Welcome " << user->getName() << "!\n";
-                    user->dashboard(library);
-                    loggedIn = true;
-                    break;
-                }
+                cout << "Login successful. Welcome " << user->getName() << "!\n";
+                user->dashboard(library);
             }
-            if (!loggedIn)
+            else
+            {
                 cout << "Invalid credentials.\n";
+            }
         }
         else if (choice == 4)
         {
@@ -998,6 +6367,9 @@ int main()
         }
     } while (true);
 
-    library.saveData();
-    return 0;
+    bool reproduced = session.finish();
+    library.stopWriter();
+    library.checkpoint();
+    library.dumpStats(cout);
+    return reproduced ? 0 : 1;
 }